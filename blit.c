@@ -0,0 +1,230 @@
+/* See LICENSE for license details. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blit.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86SIMD
+#endif
+
+static uint32_t mul8(uint32_t, uint32_t);
+static void blitfill_scalar(uint32_t *, int, int, int, uint32_t);
+static void blitmask_scalar(uint32_t *, int, const uint8_t *, int, int, int,
+			    uint32_t);
+#ifdef HAVE_X86SIMD
+static __m128i div255_sse2(__m128i);
+static void blitfill_sse2(uint32_t *, int, int, int, uint32_t);
+static void blitmask_sse2(uint32_t *, int, const uint8_t *, int, int, int,
+			  uint32_t);
+static __m256i div255_avx2(__m256i);
+static void blitfill_avx2(uint32_t *, int, int, int, uint32_t);
+static void blitmask_avx2(uint32_t *, int, const uint8_t *, int, int, int,
+			  uint32_t);
+#endif
+
+void (*blitfill)(uint32_t *, int, int, int, uint32_t) = blitfill_scalar;
+void (*blitmask)(uint32_t *, int, const uint8_t *, int, int, int,
+		 uint32_t) = blitmask_scalar;
+
+/* the four channels of p times a / 255, rounded */
+uint32_t mul8(uint32_t p, uint32_t a)
+{
+	uint32_t rb = (p & 0xff00ff) * a + 0x800080;
+	uint32_t ag = ((p >> 8) & 0xff00ff) * a + 0x800080;
+
+	rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+	ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+	return rb | ag;
+}
+
+void blitfill_scalar(uint32_t *dst, int stride, int w, int h, uint32_t c)
+{
+	int x;
+
+	for (; h > 0; h--, dst += stride) {
+		for (x = 0; x < w; x++)
+			dst[x] = c;
+	}
+}
+
+void blitmask_scalar(uint32_t *dst, int stride, const uint8_t *mask,
+		     int mstride, int w, int h, uint32_t c)
+{
+	uint32_t s;
+	int x;
+
+	for (; h > 0; h--, dst += stride, mask += mstride) {
+		for (x = 0; x < w; x++) {
+			if (mask[x] == 0) continue;
+			s      = mask[x] == 0xff ? c : mul8(c, mask[x]);
+			dst[x] = s + mul8(dst[x], 0xff - (s >> 24));
+		}
+	}
+}
+
+#ifdef HAVE_X86SIMD
+/* x / 255 for x up to 255 * 255, rounded like mul8() */
+__m128i div255_sse2(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+void blitfill_sse2(uint32_t *dst, int stride, int w, int h, uint32_t c)
+{
+	const __m128i v = _mm_set1_epi32(c);
+	int x;
+
+	for (; h > 0; h--, dst += stride) {
+		for (x = 0; x + 4 <= w; x += 4)
+			_mm_storeu_si128((__m128i *)(dst + x), v);
+		for (; x < w; x++)
+			dst[x] = c;
+	}
+}
+
+/*
+ * Four pixels at a time, each channel widened to 16 bits. The mask of a
+ * pixel is spread over its four channels.
+ */
+void blitmask_sse2(uint32_t *dst, int stride, const uint8_t *mask,
+		   int mstride, int w, int h, uint32_t c)
+{
+	const __m128i zero = _mm_setzero_si128(), ff = _mm_set1_epi16(0xff);
+	const __m128i cw = _mm_unpacklo_epi8(_mm_set1_epi32(c), zero);
+	__m128i m, mlo, mhi, slo, shi, dlo, dhi, d;
+	uint32_t m4;
+	int x;
+
+	for (; h > 0; h--, dst += stride, mask += mstride) {
+		for (x = 0; x + 4 <= w; x += 4) {
+			memcpy(&m4, mask + x, 4);
+			if (m4 == 0) continue;
+			if (m4 == 0xffffffff && c >> 24 == 0xff) {
+				_mm_storeu_si128((__m128i *)(dst + x),
+						 _mm_set1_epi32(c));
+				continue;
+			}
+			m   = _mm_unpacklo_epi8(_mm_cvtsi32_si128(m4), zero);
+			m   = _mm_unpacklo_epi16(m, m);
+			mlo = _mm_unpacklo_epi32(m, m);
+			mhi = _mm_unpackhi_epi32(m, m);
+			slo = div255_sse2(_mm_mullo_epi16(cw, mlo));
+			shi = div255_sse2(_mm_mullo_epi16(cw, mhi));
+
+			d   = _mm_loadu_si128((const __m128i *)(dst + x));
+			dlo = _mm_unpacklo_epi8(d, zero);
+			dhi = _mm_unpackhi_epi8(d, zero);
+			/* d * (255 - alpha of s) */
+			dlo = _mm_mullo_epi16(
+			    dlo, _mm_sub_epi16(
+				     ff, _mm_shufflehi_epi16(
+					     _mm_shufflelo_epi16(slo, 0xff),
+					     0xff)));
+			dhi = _mm_mullo_epi16(
+			    dhi, _mm_sub_epi16(
+				     ff, _mm_shufflehi_epi16(
+					     _mm_shufflelo_epi16(shi, 0xff),
+					     0xff)));
+			dlo = _mm_add_epi16(slo, div255_sse2(dlo));
+			dhi = _mm_add_epi16(shi, div255_sse2(dhi));
+			_mm_storeu_si128((__m128i *)(dst + x),
+					 _mm_packus_epi16(dlo, dhi));
+		}
+		blitmask_scalar(dst + x, stride, mask + x, mstride, w - x, 1,
+				c);
+	}
+}
+
+__attribute__((target("avx2"))) __m256i div255_avx2(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(0x80));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)),
+				 8);
+}
+
+__attribute__((target("avx2"))) void
+blitfill_avx2(uint32_t *dst, int stride, int w, int h, uint32_t c)
+{
+	const __m256i v = _mm256_set1_epi32(c);
+	int x;
+
+	for (; h > 0; h--, dst += stride) {
+		for (x = 0; x + 8 <= w; x += 8)
+			_mm256_storeu_si256((__m256i *)(dst + x), v);
+		for (; x < w; x++)
+			dst[x] = c;
+	}
+}
+
+/*
+ * As blitmask_sse2() with eight pixels. The unpacks work within 128-bit
+ * lanes, so the low half holds pixels 0, 1, 4 and 5, the high half 2, 3,
+ * 6 and 7, and the mask is spread the same way.
+ */
+__attribute__((target("avx2"))) void
+blitmask_avx2(uint32_t *dst, int stride, const uint8_t *mask, int mstride,
+	      int w, int h, uint32_t c)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff   = _mm256_set1_epi16(0xff);
+	const __m256i cw = _mm256_unpacklo_epi8(_mm256_set1_epi32(c), zero);
+	__m256i m, mlo, mhi, slo, shi, dlo, dhi, d;
+	uint64_t m8;
+	int x;
+
+	for (; h > 0; h--, dst += stride, mask += mstride) {
+		for (x = 0; x + 8 <= w; x += 8) {
+			memcpy(&m8, mask + x, 8);
+			if (m8 == 0) continue;
+			if (m8 == UINT64_MAX && c >> 24 == 0xff) {
+				_mm256_storeu_si256((__m256i *)(dst + x),
+						    _mm256_set1_epi32(c));
+				continue;
+			}
+			m = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+			    (const __m128i *)(mask + x)));
+			m   = _mm256_or_si256(m, _mm256_slli_epi32(m, 16));
+			mlo = _mm256_unpacklo_epi32(m, m);
+			mhi = _mm256_unpackhi_epi32(m, m);
+			slo = div255_avx2(_mm256_mullo_epi16(cw, mlo));
+			shi = div255_avx2(_mm256_mullo_epi16(cw, mhi));
+
+			d   = _mm256_loadu_si256((const __m256i *)(dst + x));
+			dlo = _mm256_unpacklo_epi8(d, zero);
+			dhi = _mm256_unpackhi_epi8(d, zero);
+			dlo = _mm256_mullo_epi16(
+			    dlo, _mm256_sub_epi16(
+				     ff, _mm256_shufflehi_epi16(
+					     _mm256_shufflelo_epi16(slo, 0xff),
+					     0xff)));
+			dhi = _mm256_mullo_epi16(
+			    dhi, _mm256_sub_epi16(
+				     ff, _mm256_shufflehi_epi16(
+					     _mm256_shufflelo_epi16(shi, 0xff),
+					     0xff)));
+			dlo = _mm256_add_epi16(slo, div255_avx2(dlo));
+			dhi = _mm256_add_epi16(shi, div255_avx2(dhi));
+			_mm256_storeu_si256((__m256i *)(dst + x),
+					    _mm256_packus_epi16(dlo, dhi));
+		}
+		blitmask_sse2(dst + x, stride, mask + x, mstride, w - x, 1, c);
+	}
+}
+#endif
+
+void blitinit(void)
+{
+#ifdef HAVE_X86SIMD
+	__builtin_cpu_init();
+	blitfill = blitfill_sse2;
+	blitmask = blitmask_sse2;
+	if (__builtin_cpu_supports("avx2")) {
+		blitfill = blitfill_avx2;
+		blitmask = blitmask_avx2;
+	}
+#endif
+}
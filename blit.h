@@ -0,0 +1,22 @@
+/* See LICENSE for license details. */
+
+#ifndef BLIT_H_
+#define BLIT_H_
+
+#include <stdint.h>
+
+/*
+ * Drawing straight into a8r8g8b8 memory. Colors are premultiplied and
+ * strides are in pixels, the mask stride in bytes.
+ */
+
+/* fills w x h pixels of dst with c */
+extern void (*blitfill)(uint32_t *dst, int stride, int w, int h, uint32_t c);
+/* blends c through the a8 mask over w x h pixels of dst */
+extern void (*blitmask)(uint32_t *dst, int stride, const uint8_t *mask,
+			int mstride, int w, int h, uint32_t c);
+
+/* picks the fastest versions the cpu supports */
+void blitinit(void);
+
+#endif
@@ -0,0 +1,178 @@
+/* See LICENSE for license details. */
+
+/*
+ * Draws frames of cells, a background and a glyph each, with pixman and
+ * with blit.c, and prints the time per frame of both and how far apart
+ * their pixels are.
+ *
+ * usage: blitbench [frames]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pixman-1/pixman.h>
+
+#include "blit.h"
+
+#define CW 10
+#define CH 20
+
+static void die(const char *);
+static double now(void);
+static void mkglyphs(void);
+static void drawpixman(pixman_image_t *, int, int, int);
+static void drawblit(pixman_image_t *, int, int, int);
+static int maxdiff(pixman_image_t *, pixman_image_t *);
+static void bench(const char *, int, int, int);
+
+static const uint32_t palette[] = {
+    0xff000000, 0xffcd0000, 0xff00cd00, 0xffcdcd00,
+    0xff0000ee, 0xffcd00cd, 0xff00cdcd, 0xffe5e5e5,
+};
+
+static pixman_image_t *glyphs[64];
+
+void die(const char *s)
+{
+	fprintf(stderr, "blitbench: %s\n", s);
+	exit(1);
+}
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* antialiased looking masks, mostly empty or solid like real glyphs */
+void mkglyphs(void)
+{
+	uint8_t *m;
+	int i, x, y, r;
+
+	srand(1);
+	for (i = 0; i < 64; i++) {
+		if (!(glyphs[i] = pixman_image_create_bits(PIXMAN_a8, CW, CH,
+							   NULL, 0)))
+			die("pixman_image_create_bits failed");
+		m = (uint8_t *)pixman_image_get_data(glyphs[i]);
+		for (y = 0; y < CH; y++) {
+			for (x = 0; x < CW; x++) {
+				r = rand() % 4;
+				m[y * pixman_image_get_stride(glyphs[i]) + x] =
+				    r == 0 ? 0xff : r == 1 ? rand() & 0xff : 0;
+			}
+		}
+	}
+}
+
+void drawpixman(pixman_image_t *dst, int cols, int rows, int frame)
+{
+	pixman_image_t *fg;
+	pixman_color_t c;
+	uint32_t p;
+	int x, y, i;
+
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols; x++) {
+			i = x + y + frame;
+			p = palette[i % 8];
+			c = (pixman_color_t){(p >> 16 & 0xff) * 0x101,
+					     (p >> 8 & 0xff) * 0x101,
+					     (p & 0xff) * 0x101, 0xffff};
+			pixman_image_fill_rectangles(
+			    PIXMAN_OP_SRC, dst, &c, 1,
+			    &(pixman_rectangle16_t){x * CW, y * CH, CW, CH});
+
+			p  = palette[(i + 3) % 8];
+			c  = (pixman_color_t){(p >> 16 & 0xff) * 0x101,
+					      (p >> 8 & 0xff) * 0x101,
+					      (p & 0xff) * 0x101, 0xffff};
+			fg = pixman_image_create_solid_fill(&c);
+			pixman_image_composite32(PIXMAN_OP_OVER, fg,
+						 glyphs[i % 64], dst, 0, 0, 0,
+						 0, x * CW, y * CH, CW, CH);
+			pixman_image_unref(fg);
+		}
+	}
+}
+
+void drawblit(pixman_image_t *dst, int cols, int rows, int frame)
+{
+	uint32_t *d = pixman_image_get_data(dst);
+	int stride  = pixman_image_get_stride(dst) / 4;
+	int x, y, i;
+
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols; x++) {
+			i = x + y + frame;
+			blitfill(d + y * CH * stride + x * CW, stride, CW, CH,
+				 palette[i % 8]);
+			blitmask(d + y * CH * stride + x * CW, stride,
+				 (uint8_t *)pixman_image_get_data(
+				     glyphs[i % 64]),
+				 pixman_image_get_stride(glyphs[i % 64]), CW,
+				 CH, palette[(i + 3) % 8]);
+		}
+	}
+}
+
+int maxdiff(pixman_image_t *a, pixman_image_t *b)
+{
+	uint32_t *pa = pixman_image_get_data(a), *pb = pixman_image_get_data(b);
+	int i, s, d, max = 0;
+	int n = pixman_image_get_stride(a) / 4 * pixman_image_get_height(a);
+
+	for (i = 0; i < n; i++) {
+		for (s = 0; s < 32; s += 8) {
+			d = abs((int)(pa[i] >> s & 0xff) - (int)(pb[i] >> s & 0xff));
+			if (d > max) max = d;
+		}
+	}
+	return max;
+}
+
+void bench(const char *name, int cols, int rows, int frames)
+{
+	pixman_image_t *a, *b;
+	double t0, tp, tb;
+	int i;
+
+	a = pixman_image_create_bits(PIXMAN_a8r8g8b8, cols * CW, rows * CH,
+				     NULL, 0);
+	b = pixman_image_create_bits(PIXMAN_a8r8g8b8, cols * CW, rows * CH,
+				     NULL, 0);
+	if (!a || !b) die("pixman_image_create_bits failed");
+
+	t0 = now();
+	for (i = 0; i < frames; i++)
+		drawpixman(a, cols, rows, i);
+	tp = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < frames; i++)
+		drawblit(b, cols, rows, i);
+	tb = now() - t0;
+
+	printf("%-6s %3dx%-3d pixman %7.3f ms  blit %7.3f ms  diff %d\n", name,
+	       cols, rows, tp / frames, tb / frames, maxdiff(a, b));
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 100;
+
+	if (frames < 1) die("usage: blitbench [frames]");
+	blitinit();
+	mkglyphs();
+	bench("80x24", 80, 24, frames);
+	bench("4k", 3840 / CW, 2160 / CH, frames);
+	return 0;
+}
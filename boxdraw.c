@@ -0,0 +1,203 @@
+/* See LICENSE for license details. */
+
+#include <stdint.h>
+
+#include <pixman-1/pixman.h>
+
+#include "boxdraw.h"
+
+/* the weight of the four arms of a line glyph, from the middle out */
+#define L 1 /* light */
+#define H 2 /* heavy */
+#define B(l, r, u, d) ((l) | (r) << 2 | (u) << 4 | (d) << 6)
+
+static void fill(pixman_image_t *, int, int, int, int, uint16_t);
+static void drawlines(pixman_image_t *, int, int, int, int);
+static void drawdashes(pixman_image_t *, int, int, int, int, int, int);
+static void drawquads(pixman_image_t *, int, int, int);
+static void drawarrow(pixman_image_t *, int, int, int);
+
+/* clang-format off */
+static const uint8_t lines[0x80] = {
+	[0x00] = B(L, L, 0, 0), [0x01] = B(H, H, 0, 0),
+	[0x02] = B(0, 0, L, L), [0x03] = B(0, 0, H, H),
+	[0x0c] = B(0, L, 0, L), [0x0d] = B(0, H, 0, L),
+	[0x0e] = B(0, L, 0, H), [0x0f] = B(0, H, 0, H),
+	[0x10] = B(L, 0, 0, L), [0x11] = B(H, 0, 0, L),
+	[0x12] = B(L, 0, 0, H), [0x13] = B(H, 0, 0, H),
+	[0x14] = B(0, L, L, 0), [0x15] = B(0, H, L, 0),
+	[0x16] = B(0, L, H, 0), [0x17] = B(0, H, H, 0),
+	[0x18] = B(L, 0, L, 0), [0x19] = B(H, 0, L, 0),
+	[0x1a] = B(L, 0, H, 0), [0x1b] = B(H, 0, H, 0),
+	[0x1c] = B(0, L, L, L), [0x1d] = B(0, H, L, L),
+	[0x1e] = B(0, L, H, L), [0x1f] = B(0, L, L, H),
+	[0x20] = B(0, L, H, H), [0x21] = B(0, H, H, L),
+	[0x22] = B(0, H, L, H), [0x23] = B(0, H, H, H),
+	[0x24] = B(L, 0, L, L), [0x25] = B(H, 0, L, L),
+	[0x26] = B(L, 0, H, L), [0x27] = B(L, 0, L, H),
+	[0x28] = B(L, 0, H, H), [0x29] = B(H, 0, H, L),
+	[0x2a] = B(H, 0, L, H), [0x2b] = B(H, 0, H, H),
+	[0x2c] = B(L, L, 0, L), [0x2d] = B(H, L, 0, L),
+	[0x2e] = B(L, H, 0, L), [0x2f] = B(H, H, 0, L),
+	[0x30] = B(L, L, 0, H), [0x31] = B(H, L, 0, H),
+	[0x32] = B(L, H, 0, H), [0x33] = B(H, H, 0, H),
+	[0x34] = B(L, L, L, 0), [0x35] = B(H, L, L, 0),
+	[0x36] = B(L, H, L, 0), [0x37] = B(H, H, L, 0),
+	[0x38] = B(L, L, H, 0), [0x39] = B(H, L, H, 0),
+	[0x3a] = B(L, H, H, 0), [0x3b] = B(H, H, H, 0),
+	[0x3c] = B(L, L, L, L), [0x3d] = B(H, L, L, L),
+	[0x3e] = B(L, H, L, L), [0x3f] = B(H, H, L, L),
+	[0x40] = B(L, L, H, L), [0x41] = B(L, L, L, H),
+	[0x42] = B(L, L, H, H), [0x43] = B(H, L, H, L),
+	[0x44] = B(L, H, H, L), [0x45] = B(H, L, L, H),
+	[0x46] = B(L, H, L, H), [0x47] = B(H, H, H, L),
+	[0x48] = B(H, H, L, H), [0x49] = B(H, L, H, H),
+	[0x4a] = B(L, H, H, H), [0x4b] = B(H, H, H, H),
+	[0x74] = B(L, 0, 0, 0), [0x75] = B(0, 0, L, 0),
+	[0x76] = B(0, L, 0, 0), [0x77] = B(0, 0, 0, L),
+	[0x78] = B(H, 0, 0, 0), [0x79] = B(0, 0, H, 0),
+	[0x7a] = B(0, H, 0, 0), [0x7b] = B(0, 0, 0, H),
+	[0x7c] = B(L, H, 0, 0), [0x7d] = B(0, 0, L, H),
+	[0x7e] = B(H, L, 0, 0), [0x7f] = B(0, 0, H, L),
+};
+
+/* the quarters of U+2596 to U+259F: upper left, upper right, lower left
+ * and lower right */
+static const uint8_t quads[10] = {
+	4, 8, 1, 1 | 4 | 8, 1 | 8, 1 | 2 | 4, 1 | 2 | 8, 2, 2 | 4, 2 | 4 | 8,
+};
+/* clang-format on */
+
+int boxidx(uint32_t u)
+{
+	if (u >= 0x2500 && u <= 0x259f) return u - 0x2500;
+	if (u >= 0xe0b0 && u <= 0xe0b3) return 0xa0 + u - 0xe0b0;
+	return -1;
+}
+
+void fill(pixman_image_t *mask, int x, int y, int w, int h, uint16_t a)
+{
+	if (w <= 0 || h <= 0) return;
+	pixman_image_fill_rectangles(
+	    PIXMAN_OP_SRC, mask, &(pixman_color_t){0, 0, 0, a}, 1,
+	    &(pixman_rectangle16_t){x, y, w, h});
+}
+
+/*
+ * Each arm runs from its edge to the middle, and on over the arms across
+ * it so that they join. Every cell puts a line of some thickness at the
+ * same place, so they meet without seams.
+ */
+void drawlines(pixman_image_t *mask, int arms, int w, int h, int lt)
+{
+	int tl = (arms & 3) * lt, tr = (arms >> 2 & 3) * lt;
+	int tu = (arms >> 4 & 3) * lt, td = (arms >> 6 & 3) * lt;
+	int vt = tu > td ? tu : td, ht = tl > tr ? tl : tr;
+	/* where the arms across start and end, or the middle */
+	int xl = vt ? (w - vt) / 2 : w / 2, xr = vt ? xl + vt : w / 2;
+	int yu = ht ? (h - ht) / 2 : h / 2, yd = ht ? yu + ht : h / 2;
+
+	if (tl) fill(mask, 0, (h - tl) / 2, xr, tl, 0xffff);
+	if (tr) fill(mask, xl, (h - tr) / 2, w - xl, tr, 0xffff);
+	if (tu) fill(mask, (w - tu) / 2, 0, tu, yd, 0xffff);
+	if (td) fill(mask, (w - td) / 2, yu, td, h - yu, 0xffff);
+}
+
+/* n dashes across the cell, half a gap at both ends to space them evenly
+ * over cells */
+void drawdashes(pixman_image_t *mask, int n, int vert, int t, int w, int h,
+		int lt)
+{
+	int len = vert ? h : w, i, a, b, gap;
+
+	t *= lt;
+	for (i = 0; i < n; i++) {
+		a   = i * len / n;
+		b   = (i + 1) * len / n;
+		gap = (b - a) / 3 > 1 ? (b - a) / 3 : 1;
+		if (vert)
+			fill(mask, (w - t) / 2, a + gap / 2, t, b - a - gap,
+			     0xffff);
+		else
+			fill(mask, a + gap / 2, (h - t) / 2, b - a - gap, t,
+			     0xffff);
+	}
+}
+
+void drawquads(pixman_image_t *mask, int q, int w, int h)
+{
+	if (q & 1) fill(mask, 0, 0, w / 2, h / 2, 0xffff);
+	if (q & 2) fill(mask, w / 2, 0, w - w / 2, h / 2, 0xffff);
+	if (q & 4) fill(mask, 0, h / 2, w / 2, h - h / 2, 0xffff);
+	if (q & 8) fill(mask, w / 2, h / 2, w - w / 2, h - h / 2, 0xffff);
+}
+
+/* a solid triangle the height of the cell, its tip on the right or left */
+void drawarrow(pixman_image_t *mask, int right, int w, int h)
+{
+	pixman_fixed_t fw = pixman_int_to_fixed(w);
+	pixman_fixed_t fh = pixman_int_to_fixed(h), mid = fh / 2;
+	pixman_fixed_t base = right ? 0 : fw, tip = right ? fw : 0;
+	pixman_line_fixed_t edge = {{base, 0}, {base, fh}};
+	pixman_line_fixed_t top = {{base, 0}, {tip, mid}};
+	pixman_line_fixed_t bot = {{tip, mid}, {base, fh}};
+
+	pixman_add_trapezoids(
+	    mask, 0, 0, 2,
+	    (pixman_trapezoid_t[]){
+		{0,   mid, right ? edge : top, right ? top : edge},
+		{mid, fh,  right ? edge : bot, right ? bot : edge},
+	    });
+}
+
+int boxdraw(pixman_image_t *mask, uint32_t u, int w, int h, int lt)
+{
+	int i = boxidx(u);
+
+	if (i < 0) return 0;
+
+	if (i < 0x80 && lines[i]) {
+		drawlines(mask, lines[i], w, h, lt);
+	} else if (i >= 0x04 && i <= 0x0b) {
+		drawdashes(mask, i < 0x08 ? 3 : 4, i & 2, i & 1 ? H : L, w, h,
+			   lt);
+	} else if (i >= 0x4c && i <= 0x4f) {
+		drawdashes(mask, 2, i & 2, i & 1 ? H : L, w, h, lt);
+	} else if (i == 0x50 || i == 0x51) {
+		/* double lines, a line's width apart */
+		if (i == 0x50) {
+			fill(mask, 0, (h - lt) / 2 - lt, w, lt, 0xffff);
+			fill(mask, 0, (h - lt) / 2 + lt, w, lt, 0xffff);
+		} else {
+			fill(mask, (w - lt) / 2 - lt, 0, lt, h, 0xffff);
+			fill(mask, (w - lt) / 2 + lt, 0, lt, h, 0xffff);
+		}
+	} else if (i == 0x80) {
+		fill(mask, 0, 0, w, h / 2, 0xffff);
+	} else if (i >= 0x81 && i <= 0x88) {
+		/* lower eighths */
+		fill(mask, 0, h - h * (i - 0x80) / 8, w, h * (i - 0x80) / 8,
+		     0xffff);
+	} else if (i >= 0x89 && i <= 0x8f) {
+		/* left eighths */
+		fill(mask, 0, 0, w * (0x90 - i) / 8, h, 0xffff);
+	} else if (i == 0x90) {
+		fill(mask, w / 2, 0, w - w / 2, h, 0xffff);
+	} else if (i >= 0x91 && i <= 0x93) {
+		/* shades */
+		fill(mask, 0, 0, w, h, 0x4040 * (i - 0x90));
+	} else if (i == 0x94) {
+		fill(mask, 0, 0, w, h / 8, 0xffff);
+	} else if (i == 0x95) {
+		fill(mask, w - w / 8, 0, w / 8, h, 0xffff);
+	} else if (i >= 0x96 && i <= 0x9f) {
+		drawquads(mask, quads[i - 0x96], w, h);
+	} else if (i == 0xa0 || i == 0xa2) {
+		drawarrow(mask, i == 0xa0, w, h);
+	} else {
+		/* the rest of the double lines, rounded corners, diagonals and
+		 * thin arrows are left to the font */
+		return 0;
+	}
+	return 1;
+}
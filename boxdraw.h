@@ -0,0 +1,23 @@
+/* See LICENSE for license details. */
+
+#ifndef BOXDRAW_H_
+#define BOXDRAW_H_
+
+#include <stdint.h>
+
+#include <pixman-1/pixman.h>
+
+/*
+ * Box-drawing (U+2500-U+257F), block (U+2580-U+259F) and Powerline arrow
+ * (U+E0B0-U+E0B3) glyphs drawn to fill a cell exactly, so that they meet
+ * the glyphs of the cells around them.
+ */
+
+#define BOXGLYPHS 164
+
+/* the index of u among them, -1 if it is not one */
+int boxidx(uint32_t u);
+/* draws u into the a8 mask of w x h, lines lt pixels thick; 0 if it can't */
+int boxdraw(pixman_image_t *mask, uint32_t u, int w, int h, int lt);
+
+#endif
@@ -38,56 +38,61 @@
 typedef struct {
 	struct wl_buffer *wl_buf;
 	int32_t size;
+	int32_t off; /* offset in the memory of the pool */
 	int busy;
-	void *mmapped;
 	pixman_image_t *pix;
+	pixman_region32_t stale; /* drawn in other buffers since this one */
 } DrwBuf;
 
+#define BUFPOOL_MAX 4
+
+/*
+ * All buffers live in one file shared with the compositor that only ever
+ * grows, buffer i in the slot at base + i * slot. Resizing the window then
+ * only recreates the wl_buffer and image of a buffer, until it outgrows its
+ * slot.
+ */
 typedef struct {
-	DrwBuf bufs[2];
+	DrwBuf bufs[BUFPOOL_MAX];
+	int n;        /* nb of buffers used, at most BUFPOOL_MAX */
+	DrwBuf *last; /* most recently drawn buffer */
+	void (*release)(void *); /* called with data when a buffer is free */
+	void *data;
+	struct wl_shm_pool *shm_pool;
+	int fd;
+	void *mmapped;
+	int32_t size; /* size of the file */
+	int32_t base; /* offset of the first slot */
+	int32_t slot; /* room for each buffer */
+	int trimmed;  /* no part of the file outside the slots is resident */
 } BufPool;
 
 static void drwbuf_cleanup(DrwBuf *buf)
 {
 	if (buf->wl_buf) wl_buffer_destroy(buf->wl_buf);
-	if (buf->mmapped) munmap(buf->mmapped, buf->size);
 	if (buf->pix) pixman_image_unref(buf->pix);
+	pixman_region32_fini(&buf->stale);
 	*buf = (DrwBuf){0};
 }
 
 static void drwbuf_handle_release(void *data, struct wl_buffer *wl_buffer)
 {
-	(void)wl_buffer;
-	DrwBuf *buf = data;
-	buf->busy   = 0;
+	BufPool *pool = data;
+	int i;
+
+	for (i = 0; i < pool->n; i++) {
+		if (pool->bufs[i].wl_buf == wl_buffer) pool->bufs[i].busy = 0;
+	}
+	if (pool->release) pool->release(pool->data);
 }
 
 static struct wl_buffer_listener drwbuf_buffer_listener = {
     .release = drwbuf_handle_release,
 };
 
-static DrwBuf *bufpool_getbuf(BufPool *pool, struct wl_shm *shm, int32_t width,
-			      int32_t height, int *resized)
+static int bufpool_open(void)
 {
-	int i;
 	int fd;
-	void *mmapped;
-	struct wl_shm_pool *shm_pool;
-	struct wl_buffer *wl_buf;
-	int32_t size = width * 4 * height;
-	pixman_image_t *pix;
-	DrwBuf *buf = NULL;
-
-	for (i = 0; i < 2; i++) {
-		if (pool->bufs[i].busy) continue;
-		if (pool->bufs[i].wl_buf && pool->bufs[i].size != size)
-			drwbuf_cleanup(&pool->bufs[i]);
-		buf = &pool->bufs[i];
-	}
-	if (!buf) return NULL;
-	*resized = 0;
-	if (buf->wl_buf && buf->size == size) return buf;
-	*resized = 1;
 
 #if defined(__linux__) ||                                                      \
     ((defined(__FreeBSD__) && (__FreeBSD_version >= 1300048)))
@@ -99,6 +104,8 @@ static DrwBuf *bufpool_getbuf(BufPool *pool, struct wl_shm *shm, int32_t width,
 							0
 #endif
 	);
+	/* the compositor must not see it shrink under its feet */
+	if (fd >= 0) fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
 #else
 	char template[] = "/tmp/drwbuf-XXXXXX";
 #if defined(__OpenBSD__)
@@ -106,51 +113,226 @@ static DrwBuf *bufpool_getbuf(BufPool *pool, struct wl_shm *shm, int32_t width,
 #else
 	fd = mkostemp(template, O_CLOEXEC);
 #endif
-	if (fd < 0) return NULL;
+	if (fd < 0) return -1;
 #if defined(__OpenBSD__)
 	shm_unlink(template);
 #else
 	unlink(template);
 #endif
 #endif
+	return fd;
+}
 
-	if ((ftruncate(fd, size)) < 0) {
-		close(fd);
-		return NULL;
+/* maps the whole file again */
+static int bufpool_map(BufPool *pool, int32_t size)
+{
+	void *mmapped;
+	pixman_image_t *pix;
+	DrwBuf *buf;
+	int i;
+
+	mmapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd,
+		       0);
+	if (mmapped == MAP_FAILED) return -1;
+
+	/* the images of the buffers still held point into the old mapping */
+	for (i = 0; i < pool->n; i++) {
+		buf = &pool->bufs[i];
+		if (!buf->pix) continue;
+		pix = pixman_image_create_bits(
+		    PIXMAN_a8r8g8b8, pixman_image_get_width(buf->pix),
+		    pixman_image_get_height(buf->pix),
+		    (uint32_t *)((char *)mmapped + buf->off),
+		    pixman_image_get_stride(buf->pix));
+		if (!pix) {
+			munmap(mmapped, size);
+			return -1;
+		}
+		pixman_image_unref(buf->pix);
+		buf->pix = pix;
 	}
+	if (pool->mmapped) munmap(pool->mmapped, pool->size);
+	pool->mmapped = mmapped;
+	pool->size    = size;
+	return 0;
+}
 
-	mmapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (mmapped == MAP_FAILED) {
-		close(fd);
-		return NULL;
+/* makes every slot hold size bytes, growing the file if needed */
+static int bufpool_reserve(BufPool *pool, struct wl_shm *shm, int32_t size)
+{
+	int i, busy = 0;
+	int64_t slot, base, end;
+
+	if (size <= pool->slot) return 0;
+
+	if (!pool->shm_pool && (pool->fd = bufpool_open()) < 0) return -1;
+
+	/* the buffers of the old slots are too small, unless still held */
+	for (i = 0; i < pool->n; i++) {
+		if (pool->bufs[i].busy) {
+			busy = 1;
+			continue;
+		}
+		if (pool->last == &pool->bufs[i]) pool->last = NULL;
+		drwbuf_cleanup(&pool->bufs[i]);
 	}
 
-#if defined(__linux__) ||                                                      \
-    ((defined(__FreeBSD__) && (__FreeBSD_version >= 1300048)))
-	fcntl(fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL);
+	/* leave room for the window to grow a bit more, and new slots after
+	 * the held buffers */
+	slot = (int64_t)size + size / 4;
+	base = busy ? pool->size : 0;
+	if (base + slot * pool->n > INT32_MAX) slot = size;
+	if ((end = base + slot * pool->n) > INT32_MAX) goto err;
+
+	if (end > pool->size) {
+		if (ftruncate(pool->fd, end) < 0 || bufpool_map(pool, end) < 0)
+			goto err;
+		if (!pool->shm_pool)
+			pool->shm_pool = wl_shm_create_pool(shm, pool->fd, end);
+		else
+			wl_shm_pool_resize(pool->shm_pool, end);
+	}
+	pool->base    = base;
+	pool->slot    = slot;
+	pool->trimmed = 0;
+
+	/* fault the new slots in now rather than while drawing */
+#if defined(MADV_POPULATE_WRITE)
+	madvise((char *)pool->mmapped + base, end - base, MADV_POPULATE_WRITE);
+#elif defined(MADV_WILLNEED)
+	madvise((char *)pool->mmapped + base, end - base, MADV_WILLNEED);
 #endif
+	return 0;
+
+err:
+	if (!pool->shm_pool) close(pool->fd);
+	return -1;
+}
+
+/*
+ * Gives back the pages of the file outside the slots once no buffer is left
+ * there, as the slots move to the end while the compositor holds a buffer.
+ */
+static void bufpool_trim(BufPool *pool)
+{
+	int i;
+	int32_t lo = pool->base, hi = pool->base + pool->slot * pool->n;
 
-	shm_pool = wl_shm_create_pool(shm, fd, size);
-	wl_buf   = wl_shm_pool_create_buffer(shm_pool, 0, width, height,
-					     width * 4, WL_SHM_FORMAT_ARGB8888);
-	wl_shm_pool_destroy(shm_pool);
-	close(fd);
-
-	buf->wl_buf  = wl_buf;
-	buf->size    = size;
-	buf->mmapped = mmapped;
-	buf->busy    = 1;
-	if (!(pix = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
-					     buf->mmapped, width * 4)))
+	if (pool->trimmed) return;
+	for (i = 0; i < pool->n; i++) {
+		if (pool->bufs[i].wl_buf &&
+		    (pool->bufs[i].off < lo || pool->bufs[i].off >= hi))
+			return;
+	}
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (lo > 0)
+		fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  0, lo);
+	if (hi < pool->size)
+		fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  hi, pool->size - hi);
+#endif
+	pool->trimmed = 1;
+}
+
+static DrwBuf *bufpool_getbuf(BufPool *pool, struct wl_shm *shm, int32_t width,
+			      int32_t height, int *resized)
+{
+	int i;
+	int32_t size = width * 4 * height;
+	DrwBuf *buf  = NULL;
+
+	if (bufpool_reserve(pool, shm, size) < 0) return NULL;
+
+	for (i = 0; i < pool->n; i++) {
+		if (pool->bufs[i].busy) continue;
+		if (pool->bufs[i].wl_buf && pool->bufs[i].size != size) {
+			if (pool->last == &pool->bufs[i]) pool->last = NULL;
+			drwbuf_cleanup(&pool->bufs[i]);
+		}
+		/* only create another buffer if none is free */
+		if (!buf || (!buf->wl_buf && pool->bufs[i].wl_buf))
+			buf = &pool->bufs[i];
+	}
+	bufpool_trim(pool);
+	if (!buf) return NULL;
+	*resized = 0;
+	if (buf->wl_buf) {
+		buf->busy = 1;
+		return buf;
+	}
+	*resized = 1;
+
+	buf->off  = pool->base + (buf - pool->bufs) * pool->slot;
+	buf->size = size;
+	buf->busy = 1;
+	if (!(buf->pix = pixman_image_create_bits(
+		  PIXMAN_a8r8g8b8, width, height,
+		  (uint32_t *)((char *)pool->mmapped + buf->off), width * 4))) {
 		drwbuf_cleanup(buf);
-	buf->pix = pix;
-	wl_buffer_add_listener(wl_buf, &drwbuf_buffer_listener, buf);
+		return NULL;
+	}
+	buf->wl_buf = wl_shm_pool_create_buffer(pool->shm_pool, buf->off, width,
+						height, width * 4,
+						WL_SHM_FORMAT_ARGB8888);
+	pixman_region32_init_rect(&buf->stale, 0, 0, width, height);
+	wl_buffer_add_listener(buf->wl_buf, &drwbuf_buffer_listener, pool);
 	return buf;
 }
 
+/*
+ * Copies what was drawn in the other buffers since buf was last drawn from
+ * the most recent one, so that only new changes have to be drawn in buf.
+ * Returns 0 if there was nothing of the same size to copy from.
+ */
+static int bufpool_copyforward(BufPool *pool, DrwBuf *buf)
+{
+	DrwBuf *src = pool->last;
+	int w = pixman_image_get_width(buf->pix);
+	int h = pixman_image_get_height(buf->pix);
+
+	if (!src || src == buf) return src != NULL;
+	if (pixman_image_get_width(src->pix) != w ||
+	    pixman_image_get_height(src->pix) != h)
+		return 0;
+
+	if (pixman_region32_not_empty(&buf->stale)) {
+		pixman_image_set_clip_region32(buf->pix, &buf->stale);
+		pixman_image_composite32(PIXMAN_OP_SRC, src->pix, NULL,
+					 buf->pix, 0, 0, 0, 0, 0, 0, w, h);
+		pixman_image_set_clip_region32(buf->pix, NULL);
+		pixman_region32_clear(&buf->stale);
+	}
+	return 1;
+}
+
+/* records that damage was drawn in buf, which becomes the most recent */
+static void bufpool_damage(BufPool *pool, DrwBuf *buf,
+			   pixman_region32_t *damage)
+{
+	int i;
+
+	for (i = 0; i < pool->n; i++) {
+		if (&pool->bufs[i] == buf || !pool->bufs[i].wl_buf) continue;
+		pixman_region32_union(&pool->bufs[i].stale,
+				      &pool->bufs[i].stale, damage);
+	}
+	pixman_region32_clear(&buf->stale);
+	pool->last = buf;
+}
+
 static void bufpool_cleanup(BufPool *pool)
 {
 	int i;
-	for (i = 0; i < 2; i++)
+	for (i = 0; i < BUFPOOL_MAX; i++)
 		drwbuf_cleanup(&pool->bufs[i]);
+	if (pool->shm_pool) {
+		wl_shm_pool_destroy(pool->shm_pool);
+		close(pool->fd);
+	}
+	if (pool->mmapped) munmap(pool->mmapped, pool->size);
+	pool->last     = NULL;
+	pool->shm_pool = NULL;
+	pool->mmapped  = NULL;
+	pool->size = pool->base = pool->slot = 0;
 }
@@ -62,6 +62,39 @@ const int allowwindowops = 0;
 static const double minlatency = 2;
 static const double maxlatency = 33;
 
+/*
+ * nb of buffers to draw into, from 1 to 4. With more of them a frame can be
+ * drawn while the compositor still holds the previous ones, with fewer less
+ * of each frame has to be copied forward into the buffer that is reused.
+ */
+static const int buffers = 2;
+
+/*
+ * bytes of memory for cells kept drawn to be copied, 0 to draw every cell.
+ * Not used with LIGATURES.
+ */
+static const size_t tilecache = 4 << 20;
+
+/*
+ * runs of cells kept shaped, as fcft gave them. Only used with LIGATURES.
+ */
+static const int runcache = 1024;
+
+/*
+ * box-drawing, block and Powerline arrow glyphs are drawn by swt to fit the
+ * cells, rather than by the font, with light lines boxthickness pixels
+ * thick (0 for the underline thickness of the font) and heavy ones twice
+ * that.
+ */
+static const int boxglyphs    = 1;
+static const int boxthickness = 0;
+
+/*
+ * sets of fonts kept loaded, with their glyphs, for the sizes and scales
+ * used last, so that zooming back and forth draws nothing again.
+ */
+static const int fontsets = 4;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
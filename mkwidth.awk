@@ -0,0 +1,115 @@
+# Generates width.h, the column widths of all runes, from the Unicode
+# Character Database:
+#
+#	awk -f mkwidth.awk EastAsianWidth.txt DerivedGeneralCategory.txt
+#
+# Wide and fullwidth characters take two columns, which covers emoji with
+# default emoji presentation, nonspacing and enclosing marks, invisible
+# format characters and Hangul medial and final jamo take none, everything
+# else takes one. The widths are stored two bits each in blocks of 256 runes,
+# identical blocks are shared.
+
+function hex(s,    i, n)
+{
+	n = 0
+	s = toupper(s)
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789ABCDEF", substr(s, i, 1)) - 1
+	return n
+}
+
+# calls set(lo, hi, value) for the range and property of a data line
+function parse(    f, r)
+{
+	sub(/#.*/, "")
+	gsub(/[ \t]/, "")
+	if ($0 == "") return 0
+	split($0, f, ";")
+	if (index(f[1], "..")) {
+		split(f[1], r, "\\.\\.")
+		lo = hex(r[1])
+		hi = hex(r[2])
+	} else {
+		lo = hi = hex(f[1])
+	}
+	prop = f[2]
+	return 1
+}
+
+function set(lo, hi, v,    c)
+{
+	for (c = lo; c <= hi; c++)
+		w[c] = v
+}
+
+BEGIN {
+	# unassigned code points in the ideograph ranges default to wide
+	set(hex("3400"), hex("4DBF"), 2)
+	set(hex("4E00"), hex("9FFF"), 2)
+	set(hex("F900"), hex("FAFF"), 2)
+	set(hex("20000"), hex("2FFFD"), 2)
+	set(hex("30000"), hex("3FFFD"), 2)
+}
+
+FNR == 1 && match($0, /[0-9]+\.[0-9]+\.[0-9]+/) {
+	version = substr($0, RSTART, RLENGTH)
+}
+
+FILENAME ~ /EastAsianWidth/ && parse() {
+	set(lo, hi, (prop == "W" || prop == "F") ? 2 : 1)
+}
+
+FILENAME ~ /DerivedGeneralCategory/ && parse() {
+	if (prop == "Mn" || prop == "Me" || prop == "Cf")
+		set(lo, hi, 0)
+}
+
+END {
+	w[hex("00AD")] = 1 # SOFT HYPHEN is visible
+	w[hex("200B")] = 0 # ZERO WIDTH SPACE
+	# prepended concatenation marks are format characters that show
+	set(hex("0600"), hex("0605"), 1)
+	w[hex("06DD")] = w[hex("070F")] = w[hex("08E2")] = 1
+	set(hex("0890"), hex("0891"), 1)
+	w[hex("110BD")] = w[hex("110CD")] = 1
+	set(hex("1160"), hex("11FF"), 0)
+	set(hex("D7B0"), hex("D7FF"), 0)
+
+	nblk = 0
+	for (b = 0; b < 4352; b++) {
+		key = ""
+		for (i = 0; i < 256; i += 4) {
+			byte = 0
+			for (j = 3; j >= 0; j--) {
+				c = b * 256 + i + j
+				byte = byte * 4 + ((c in w) ? w[c] : 1)
+			}
+			key = key sprintf("0x%02x,", byte)
+		}
+		if (!(key in blkid)) {
+			blkid[key] = nblk
+			blk[nblk++] = key
+		}
+		idx[b] = blkid[key]
+	}
+	if (nblk > 256) {
+		print "mkwidth.awk: too many blocks" > "/dev/stderr"
+		exit 1
+	}
+
+	printf("/* generated by mkwidth.awk from Unicode %s, do not edit */\n\n",
+	       version)
+	printf("static const unsigned char widthidx[%d] = {", 4352)
+	for (b = 0; b < 4352; b++)
+		printf("%s%d,", b % 16 ? " " : "\n\t", idx[b])
+	printf("\n};\n\n")
+	printf("static const unsigned char widthblk[%d][64] = {\n", nblk)
+	for (i = 0; i < nblk; i++) {
+		printf("\t{")
+		n = split(blk[i], f, ",")
+		for (j = 1; j < n; j++)
+			printf("%s%s,", (j - 1) % 8 ? " " : "\n\t\t", f[j])
+		printf("\n\t},\n")
+	}
+	printf("};\n")
+}
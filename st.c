@@ -20,8 +20,14 @@
 
 #include "st.h"
 #include "util.h"
+#include "width.h"
 #include "win.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86SIMD
+#endif
+
 #if defined(__linux)
 #include <pty.h>
 #elif defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
@@ -35,6 +41,10 @@
 #define UTF_SIZ     4
 #define ESC_BUF_SIZ (128 * UTF_SIZ)
 #define ESC_ARG_SIZ 16
+#define ESC_SUB_SIZ 6
+#define STYLE_MAX   (1 << 16) /* ids have to fit Glyph.style */
+#define SCROLL_MAX  8
+#define ESC_ARG_MAX 65535
 #define STR_BUF_SIZ ESC_BUF_SIZ
 #define STR_ARG_SIZ ESC_ARG_SIZ
 
@@ -44,6 +54,8 @@
 #define ISCONTROLC1(c) (BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)   (ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)     (u && wcschr(worddelimiters, u))
+#define ISBLANK(g)                                                             \
+	((g).u == ' ' && !((g).mode & (ATTR_UNDERLINE | ATTR_STRUCK)))
 
 enum term_mode {
 	MODE_WRAP      = 1 << 0,
@@ -73,16 +85,44 @@ enum charset {
 	CS_FIN
 };
 
+/* parser states, after the DEC compatible VT500 state diagram */
 enum escape_state {
-	ESC_START      = 1,
-	ESC_CSI        = 2,
-	ESC_STR        = 4, /* DCS, OSC, PM, APC */
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END    = 16, /* a final string was encountered */
-	ESC_TEST       = 32, /* Enter in test mode */
-	ESC_UTF8       = 64,
+	ESC_GROUND,
+	ESC_START,
+	ESC_ALTCHARSET, /* ESC ( ) * + */
+	ESC_TEST,       /* ESC # */
+	ESC_UTF8,       /* ESC % */
+	ESC_CSI,
+	ESC_CSI_PARAM,
+	ESC_CSI_INTER,
+	ESC_CSI_IGNORE,
+	ESC_STR,     /* DCS, OSC, PM, APC */
+	ESC_STR_END, /* ESC inside a string, ST may follow */
+	ESC_NSTATES
+};
+
+/* what to do with a character on a state transition */
+enum escape_action {
+	ACT_NONE,
+	ACT_PRINT,
+	ACT_EXEC,
+	ACT_CLEAR,
+	ACT_COLLECT,
+	ACT_PARAM,
+	ACT_CSI,
+	ACT_ESC,
+	ACT_CHARSET,
+	ACT_TEST,
+	ACT_UTF8,
+	ACT_STRPUT,
+	ACT_STREND
 };
 
+/* characters below 0xA0 are classes of their own */
+#define CLS_HIGH   0xA0 /* any other printable rune */
+#define CLS_C1UTF8 0xA1 /* C1 control decoded in UTF-8 mode */
+#define CLS_NUM    0xA2
+
 typedef struct {
 	Glyph attr; /* current char attributes */
 	int x;
@@ -108,20 +148,45 @@ typedef struct {
 	int alt;
 } Selection;
 
+/* columns x1 up to, but not including, x2 of a line; empty if x1 >= x2 */
+typedef struct {
+	int x1, x2;
+} Span;
+
+/* rows top to bot scrolled up by n, down if negative, but not drawn yet */
+typedef struct {
+	int top, bot, n;
+} Scroll;
+
+/*
+ * Storage of a screen: all its cells in one arena, with the rows addressed
+ * through a ring of pointers. The ring is stored twice in a row, so the
+ * rows from any head on can be indexed as a plain array.
+ */
+typedef struct {
+	Glyph *cells; /* row * col cells */
+	Line *ring;   /* 2 * row pointers into cells */
+	int head;     /* ring index of the top row */
+} Screen;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;         /* nb row */
 	int col;         /* nb col */
-	Line *line;      /* screen */
-	Line *alt;       /* alternate screen */
-	int *dirty;      /* dirtyness of lines */
+	Line *line;      /* screen, points into scr[0].ring */
+	Line *alt;       /* alternate screen, points into scr[1].ring */
+	Screen scr[2];   /* storage of line and alt */
+	Span *dirty;     /* dirty columns of lines */
+	Scroll scroll[SCROLL_MAX]; /* scrolls to apply to the drawn lines */
+	int nscroll;
 	TCursor c;       /* cursor */
+	TCursor sc[2];   /* saved cursors of both screens */
 	int ocx;         /* old cursor col */
 	int ocy;         /* old cursor row */
 	int top;         /* top    scroll limit */
 	int bot;         /* bottom scroll limit */
 	int mode;        /* terminal mode flags */
-	int esc;         /* escape state flags */
+	int esc;         /* escape parser state */
 	char trantbl[4]; /* charset table translation */
 	int charset;     /* current charset */
 	int icharset;    /* selected charset for sequence */
@@ -130,14 +195,16 @@ typedef struct {
 } Term;
 
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [[ [<priv>] <arg> [:<sub>]... [;]] <mode> [<mode>]] */
 typedef struct {
-	char buf[ESC_BUF_SIZ]; /* raw string */
+	char buf[ESC_BUF_SIZ]; /* raw string, only kept for csidump() */
 	size_t len;            /* raw string length */
 	char priv;
 	int arg[ESC_ARG_SIZ];
-	int narg; /* nb of args */
-	char mode[2];
+	int narg; /* nb of args, index of the current one while parsing */
+	int sub[ESC_ARG_SIZ][ESC_SUB_SIZ]; /* colon separated sub-params */
+	int nsub[ESC_ARG_SIZ];             /* nb of sub-params of each arg */
+	char mode[2]; /* intermediates and final character */
 } CSIEscape;
 
 /* STR Escape sequence structs */
@@ -158,16 +225,17 @@ static void ttywriteraw(const char *, size_t);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
 static void csireset(void);
 static void osc_color_response(int, int, int);
-static int eschandle(uchar);
+static void eschandle(uchar);
+static void escinit(void);
+static void escset(int, int, int, int, int);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
 
-static void tprinter(char *, size_t);
+static void tprinter(const char *, size_t);
 static void tdumpsel(void);
 static void tdumpline(int);
 static void tdump(void);
@@ -183,12 +251,27 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputascii(const char *, int);
+static void tputrunes(const Rune *, int);
+static int tnarrowrun(const Rune *, int);
 static void treset(void);
+static void styleinit(void);
+static ushort tstyleid(const Style *);
+static void tstylecompact(void);
+static void tstylerehash(void);
+static uint stylehashof(const Style *);
 static void tscrollup(int, int);
 static void tscrolldown(int, int);
-static void tsetattr(const int *, int);
+static void tswaplines(int, int);
+static void trotate(int);
+static void tresizescreen(Screen *, int, int, int);
+static void tsetattr(const CSIEscape *);
 static void tsetchar(Rune, const Glyph *, int, int);
+static void tsetchars(const Rune *, int, const Glyph *, int, int);
+static Rune tgraphic0(Rune);
 static void tsetdirt(int, int);
+static void tsetdirtcols(int, int, int);
+static void tscrolldirt(int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
 static void tsetmode(int, int, const int *, int);
@@ -198,6 +281,7 @@ static void tcontrolcode(uchar);
 static void tdectest(char);
 static void tdefutf8(char);
 static int32_t tdefcolor(const int *, int *, int);
+static int32_t tdefcolorsub(const int *, int);
 static void tdeftran(char);
 static void tstrsequence(uchar);
 
@@ -212,6 +296,22 @@ static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
 
+static size_t utf8decodeblock(const char *, size_t, Rune *, size_t *);
+static inline int runewidth(Rune);
+
+static size_t asciirun_scalar(const char *, size_t);
+static size_t asciiwiden_scalar(const char *, size_t, Rune *);
+static size_t utf8valid_scalar(const char *, size_t);
+#ifdef HAVE_X86SIMD
+static size_t asciirun_sse2(const char *, size_t);
+static size_t asciirun_avx2(const char *, size_t);
+static size_t asciiwiden_sse4(const char *, size_t, Rune *);
+static size_t asciiwiden_avx2(const char *, size_t, Rune *);
+static size_t utf8valid_sse4(const char *, size_t);
+static size_t utf8valid_avx2(const char *, size_t);
+#endif
+static void simdinit(void);
+
 static char *base64dec(const char *);
 static char base64dec_getc(const char **);
 
@@ -219,9 +319,13 @@ static ssize_t xwrite(int, const char *, size_t);
 
 /* Globals */
 static Term term;
+static uchar esctbl[ESC_NSTATES][CLS_NUM]; /* action << 4 | next state */
 static Selection sel;
 static CSIEscape csiescseq;
 static STREscape strescseq;
+static Style *style;   /* interned styles, 0 is the default one */
+static int *stylehash; /* 2 * stylesiz slots of ids, -1 if empty */
+static int nstyle, stylesiz;
 static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
@@ -232,6 +336,11 @@ static const Rune utfmin[UTF_SIZ + 1]   = {0, 0, 0x80, 0x800, 0x10000};
 static const Rune utfmax[UTF_SIZ + 1]   = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF,
 					   0x10FFFF};
 
+/* block helpers, replaced by the best variant for the cpu in simdinit() */
+static size_t (*asciirun)(const char *, size_t)            = asciirun_scalar;
+static size_t (*asciiwiden)(const char *, size_t, Rune *) = asciiwiden_scalar;
+static size_t (*utf8valid)(const char *, size_t)           = utf8valid_scalar;
+
 ssize_t xwrite(int fd, const char *s, size_t len)
 {
 	size_t aux = len;
@@ -330,6 +439,307 @@ size_t utf8validate(Rune *u, size_t i)
 	return i;
 }
 
+/* number of columns a printable rune takes, from the tables in width.h */
+int runewidth(Rune u)
+{
+	if (u > 0x10FFFF) return 1;
+	return (widthblk[widthidx[u >> 8]][(u & 0xFF) >> 2] >> 2 * (u & 3)) & 3;
+}
+
+size_t asciirun_scalar(const char *s, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && BETWEEN((uchar)s[i], 0x20, 0x7e); i++)
+		;
+	return i;
+}
+
+#ifdef HAVE_X86SIMD
+/*
+ * The compares are signed, so bytes >= 0x80 fail the "greater than 0x1f"
+ * test together with C0 controls and only DEL has to be masked out.
+ */
+size_t asciirun_sse2(const char *s, size_t n)
+{
+	const __m128i us = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+	__m128i v;
+	uint mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = _mm_movemask_epi8(_mm_andnot_si128(
+		    _mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, us)));
+		if (mask != 0xffff) return i + __builtin_ctz(~mask);
+	}
+	return i + asciirun_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t asciirun_avx2(const char *s, size_t n)
+{
+	const __m256i us = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f);
+	__m256i v;
+	uint mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(s + i));
+		mask = _mm256_movemask_epi8(_mm256_andnot_si256(
+		    _mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, us)));
+		if (mask != 0xffffffff) return i + __builtin_ctz(~mask);
+	}
+	return i + asciirun_sse2(s + i, n - i);
+}
+#endif
+
+/*
+ * Decodes as much of s as possible into u, which must have room for n runes.
+ * Decoding stops before an ESC, as it may switch the terminal out of UTF-8
+ * mode, and before an incomplete trailing sequence. Invalid input gives the
+ * same result as repeated utf8decode() calls. Returns the number of bytes
+ * consumed and stores the number of runes in *nu.
+ */
+size_t utf8decodeblock(const char *s, size_t n, Rune *u, size_t *nu)
+{
+	const char *esc;
+	size_t i = 0, j = 0, v = 0, m = n, len;
+	uchar c;
+
+	if ((esc = memchr(s, '\033', n))) n = esc - s;
+
+	while (i < n) {
+		/* validate a window at a time, it is redone after any error */
+		if (i >= v) v = i + utf8valid(s + i, MIN(n - i, 256));
+		/* sequences that end inside the validated prefix need no checks */
+		while (i < v) {
+			c = s[i];
+			if (c < 0x80) {
+				len = asciiwiden(s + i, v - i, u + j);
+				i += len;
+				j += len;
+				continue;
+			}
+			len = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+			if (i + len > v) break;
+			switch (len) {
+			case 2: u[j] = (c & 0x1F) << 6 | (s[i + 1] & 0x3F); break;
+			case 3:
+				u[j] = (c & 0x0F) << 12 | (s[i + 1] & 0x3F) << 6 |
+				       (s[i + 2] & 0x3F);
+				break;
+			case 4:
+				u[j] = (c & 0x07) << 18 | (s[i + 1] & 0x3F) << 12 |
+				       (s[i + 2] & 0x3F) << 6 | (s[i + 3] & 0x3F);
+				break;
+			}
+			i += len;
+			j++;
+		}
+		if (i >= n) break;
+		/* a sequence cut short by ESC is invalid, not incomplete */
+		if (!(len = utf8decode(s + i, &u[j], m - i))) break;
+		i += len;
+		j++;
+	}
+	*nu = j;
+	return i;
+}
+
+size_t asciiwiden_scalar(const char *s, size_t n, Rune *u)
+{
+	size_t i;
+
+	for (i = 0; i < n && !(s[i] & 0x80); i++)
+		u[i] = s[i];
+	return i;
+}
+
+size_t utf8valid_scalar(const char *s, size_t n)
+{
+	(void)s;
+	(void)n;
+	return 0;
+}
+
+#ifdef HAVE_X86SIMD
+/*
+ * Block validation after Keiser and Lemire, "Validating UTF-8 In Less Than
+ * One Instruction Per Byte": every byte pair is classified by three nibble
+ * lookups whose intersection is a set of error bits, where third and fourth
+ * bytes of a sequence are expected to show up as two continuations. Only
+ * whole blocks are validated, the caller checks whatever straddles the end.
+ */
+#define U8_TOO_SHORT  (1 << 0)
+#define U8_TOO_LONG   (1 << 1)
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE  (1 << 3)
+#define U8_SURROGATE  (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE2 (1 << 6) /* also overlong 4 */
+#define U8_TWO_CONTS  (1 << 7)
+#define U8_CARRY      (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_BYTE1HIGH                                                           \
+	U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,       \
+	    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, (char)U8_TWO_CONTS,         \
+	    (char)U8_TWO_CONTS, (char)U8_TWO_CONTS, (char)U8_TWO_CONTS,        \
+	    U8_TOO_SHORT | U8_OVERLONG_2, U8_TOO_SHORT,                        \
+	    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,                       \
+	    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE2
+#define U8_BYTE1LOW                                                            \
+	(char)(U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_TOO_LARGE2),      \
+	    (char)(U8_CARRY | U8_OVERLONG_2), (char)U8_CARRY, (char)U8_CARRY,  \
+	    (char)(U8_CARRY | U8_TOO_LARGE),                                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2 | U8_SURROGATE),    \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2),                   \
+	    (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE2)
+#define U8_BYTE2HIGH                                                           \
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,  \
+	    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,                          \
+	    (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS |                \
+		   U8_OVERLONG_3 | U8_TOO_LARGE2),                             \
+	    (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS |                \
+		   U8_OVERLONG_3 | U8_TOO_LARGE),                              \
+	    (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS |                \
+		   U8_SURROGATE | U8_TOO_LARGE),                               \
+	    (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS |                \
+		   U8_SURROGATE | U8_TOO_LARGE),                               \
+	    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+
+__attribute__((target("sse4.1"))) size_t
+asciiwiden_sse4(const char *s, size_t n, Rune *u)
+{
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(v)) break;
+		_mm_storeu_si128((__m128i *)(u + i), _mm_cvtepu8_epi32(v));
+		_mm_storeu_si128((__m128i *)(u + i + 4),
+				 _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)));
+		_mm_storeu_si128((__m128i *)(u + i + 8),
+				 _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+		_mm_storeu_si128((__m128i *)(u + i + 12),
+				 _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)));
+	}
+	return i + asciiwiden_scalar(s + i, n - i, u + i);
+}
+
+__attribute__((target("avx2"))) size_t
+asciiwiden_avx2(const char *s, size_t n, Rune *u)
+{
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(v)) break;
+		_mm256_storeu_si256((__m256i *)(u + i), _mm256_cvtepu8_epi32(v));
+		_mm256_storeu_si256((__m256i *)(u + i + 8),
+				    _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+	}
+	return i + asciiwiden_scalar(s + i, n - i, u + i);
+}
+
+__attribute__((target("sse4.1"))) size_t utf8valid_sse4(const char *s,
+							 size_t n)
+{
+	const __m128i b1h = _mm_setr_epi8(U8_BYTE1HIGH);
+	const __m128i b1l = _mm_setr_epi8(U8_BYTE1LOW);
+	const __m128i b2h = _mm_setr_epi8(U8_BYTE2HIGH);
+	const __m128i nib = _mm_set1_epi8(0x0F);
+	__m128i in, prev = _mm_setzero_si128(), prev1, err, must23;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		in    = _mm_loadu_si128((const __m128i *)(s + i));
+		prev1 = _mm_alignr_epi8(in, prev, 15);
+		err   = _mm_and_si128(
+		      _mm_and_si128(
+			  _mm_shuffle_epi8(
+			      b1h, _mm_and_si128(_mm_srli_epi16(prev1, 4), nib)),
+			  _mm_shuffle_epi8(b1l, _mm_and_si128(prev1, nib))),
+		      _mm_shuffle_epi8(b2h,
+				       _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+		/* only leads of 3 and 4 byte sequences keep the top bit */
+		must23 = _mm_and_si128(
+		    _mm_or_si128(
+			_mm_subs_epu8(_mm_alignr_epi8(in, prev, 14),
+				      _mm_set1_epi8(0xE0 - 0x80)),
+			_mm_subs_epu8(_mm_alignr_epi8(in, prev, 13),
+				      _mm_set1_epi8(0xF0 - 0x80))),
+		    _mm_set1_epi8((char)0x80));
+		err = _mm_xor_si128(err, must23);
+		if (!_mm_testz_si128(err, err)) break;
+		prev = in;
+	}
+	return i;
+}
+
+__attribute__((target("avx2"))) size_t utf8valid_avx2(const char *s, size_t n)
+{
+	const __m256i b1h = _mm256_setr_epi8(U8_BYTE1HIGH, U8_BYTE1HIGH);
+	const __m256i b1l = _mm256_setr_epi8(U8_BYTE1LOW, U8_BYTE1LOW);
+	const __m256i b2h = _mm256_setr_epi8(U8_BYTE2HIGH, U8_BYTE2HIGH);
+	const __m256i nib = _mm256_set1_epi8(0x0F);
+	__m256i in, prev = _mm256_setzero_si256(), carry, prev1, err, must23;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		in = _mm256_loadu_si256((const __m256i *)(s + i));
+		/* alignr works per lane, so give it the bytes across lanes */
+		carry = _mm256_permute2x128_si256(prev, in, 0x21);
+		prev1 = _mm256_alignr_epi8(in, carry, 15);
+		err   = _mm256_and_si256(
+		      _mm256_and_si256(
+			  _mm256_shuffle_epi8(
+			      b1h,
+			      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+			  _mm256_shuffle_epi8(b1l, _mm256_and_si256(prev1, nib))),
+		      _mm256_shuffle_epi8(
+			  b2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+		must23 = _mm256_and_si256(
+		    _mm256_or_si256(
+			_mm256_subs_epu8(_mm256_alignr_epi8(in, carry, 14),
+					 _mm256_set1_epi8(0xE0 - 0x80)),
+			_mm256_subs_epu8(_mm256_alignr_epi8(in, carry, 13),
+					 _mm256_set1_epi8(0xF0 - 0x80))),
+		    _mm256_set1_epi8((char)0x80));
+		err = _mm256_xor_si256(err, must23);
+		if (!_mm256_testz_si256(err, err)) break;
+		prev = in;
+	}
+	return i;
+}
+#endif
+
+void simdinit(void)
+{
+#ifdef HAVE_X86SIMD
+	__builtin_cpu_init();
+	asciirun = asciirun_sse2;
+	if (__builtin_cpu_supports("sse4.1")) {
+		asciiwiden = asciiwiden_sse4;
+		utf8valid  = utf8valid_sse4;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		asciirun   = asciirun_avx2;
+		asciiwiden = asciiwiden_avx2;
+		utf8valid  = utf8valid_avx2;
+	}
+#endif
+}
+
 char base64dec_getc(const char **src)
 {
 	while (**src && !isprint((unsigned char)**src))
@@ -755,22 +1165,24 @@ int ttynew(const char *line, char *cmd, const char *out, char **args)
 
 size_t ttyread(void)
 {
-	static char buf[BUFSIZ];
+	/* room in front of the read for an incomplete UTF-8 sequence */
+	static char buf[UTF_SIZ + BUFSIZ];
 	static int buflen = 0;
+	char *p;
 	int ret, written;
 
-	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf + buflen, LEN(buf) - buflen);
+	ret = read(cmdfd, buf + UTF_SIZ, BUFSIZ);
 
 	switch (ret) {
 	case 0:  exit(0); /* TODO: this should set running to false */
 	case -1: die("couldn't read from shell: %s\n", strerror(errno)); break;
 	default:
+		p = buf + UTF_SIZ - buflen;
 		buflen += ret;
-		written = twrite(buf, buflen, 0);
+		written = twrite(p, buflen, 0);
 		buflen -= written;
-		/* keep any incomplete UTF-8 byte sequence for the next call */
-		if (buflen > 0) memmove(buf, buf + written, buflen);
+		/* carry the incomplete sequence over in front of the next read */
+		if (buflen > 0) memmove(buf + UTF_SIZ - buflen, p + written, buflen);
 	}
 	return ret;
 }
@@ -894,7 +1306,21 @@ void tsetdirt(int top, int bot)
 	LIMIT(bot, 0, term.row - 1);
 
 	for (i = top; i <= bot; i++)
-		term.dirty[i] = 1;
+		term.dirty[i] = (Span){0, term.col};
+}
+
+/* marks columns x1 up to x2 of line y as dirty */
+void tsetdirtcols(int y, int x1, int x2)
+{
+	Span *d = &term.dirty[y];
+
+	if (d->x1 >= d->x2) {
+		d->x1 = x1;
+		d->x2 = x2;
+	} else {
+		d->x1 = MIN(d->x1, x1);
+		d->x2 = MAX(d->x2, x2);
+	}
 }
 
 void tsetdirtattr(int attr)
@@ -911,12 +1337,54 @@ void tsetdirtattr(int attr)
 	}
 }
 
-void tfulldirt(void) { tsetdirt(0, term.row - 1); }
+void tfulldirt(void)
+{
+	/* nothing drawn is kept */
+	term.nscroll = 0;
+	tsetdirt(0, term.row - 1);
+}
+
+/*
+ * Moves the dirty marks along with the lines from orig to the bottom of the
+ * scroll region that are scrolled up by n, down if negative, and queues the
+ * scroll for the lines already drawn to be moved rather than drawn again.
+ */
+void tscrolldirt(int orig, int n)
+{
+	Scroll *s = term.nscroll > 0 ? &term.scroll[term.nscroll - 1] : NULL;
+	int h = term.bot - orig + 1, k = abs(n);
+
+	if (n == 0) return;
+
+	/* the old cursor is moved too and has to be erased where it lands */
+	if (BETWEEN(term.ocy, orig, term.bot) && term.ocx < term.col)
+		tsetdirtcols(term.ocy, term.ocx, MIN(term.ocx + 2, term.col));
+
+	if (n > 0) {
+		memmove(&term.dirty[orig], &term.dirty[orig + k],
+			(h - k) * sizeof(*term.dirty));
+		tsetdirt(term.bot - k + 1, term.bot);
+	} else {
+		memmove(&term.dirty[orig + k], &term.dirty[orig],
+			(h - k) * sizeof(*term.dirty));
+		tsetdirt(orig, orig + k - 1);
+	}
+
+	if (s && s->top == orig && s->bot == term.bot) {
+		s->n += n;
+		/* past h every line is dirty and the value does not matter */
+		LIMIT(s->n, -h, h);
+	} else if (term.nscroll < SCROLL_MAX) {
+		term.scroll[term.nscroll++] = (Scroll){orig, term.bot, n};
+	} else {
+		tfulldirt();
+	}
+}
 
 void tcursor(int mode)
 {
-	static TCursor c[2];
-	int alt = IS_SET(MODE_ALTSCREEN);
+	TCursor *c = term.sc;
+	int alt    = IS_SET(MODE_ALTSCREEN);
 
 	if (mode == CURSOR_SAVE) {
 		c[alt] = term.c;
@@ -931,7 +1399,7 @@ void treset(void)
 	int i;
 
 	term.c = (TCursor){
-	    {.mode = ATTR_NULL, .fg = defaultfg, .bg = defaultbg},
+	    {.mode = ATTR_NULL, .style = 0},
 	    .x     = 0,
 	    .y     = 0,
 	    .state = CURSOR_DEFAULT
@@ -956,7 +1424,10 @@ void treset(void)
 
 void tnew(int col, int row)
 {
-	term = (Term){.c = {.attr = {.fg = defaultfg, .bg = defaultbg}}};
+	term = (Term){0};
+	simdinit();
+	escinit();
+	styleinit();
 	tresize(col, row);
 	treset();
 }
@@ -964,27 +1435,53 @@ void tnew(int col, int row)
 void tswapscreen(void)
 {
 	Line *tmp = term.line;
+	Screen scr = term.scr[0];
 
-	term.line = term.alt;
-	term.alt  = tmp;
+	term.line   = term.alt;
+	term.alt    = tmp;
+	term.scr[0] = term.scr[1];
+	term.scr[1] = scr;
 	term.mode ^= MODE_ALTSCREEN;
 	tfulldirt();
 }
 
+/* swaps rows a and b of the screen, keeping both copies of the ring */
+void tswaplines(int a, int b)
+{
+	Screen *s = &term.scr[0];
+	int ra = s->head + a, rb = s->head + b;
+	Line temp;
+
+	temp         = s->ring[ra];
+	s->ring[ra]  = s->ring[rb];
+	s->ring[rb]  = temp;
+	s->ring[ra < term.row ? ra + term.row : ra - term.row] = s->ring[ra];
+	s->ring[rb < term.row ? rb + term.row : rb - term.row] = s->ring[rb];
+}
+
+/* scrolls the whole screen up by n rows, down if n is negative */
+void trotate(int n)
+{
+	Screen *s = &term.scr[0];
+
+	s->head   = (s->head + n + term.row) % term.row;
+	term.line = s->ring + s->head;
+}
+
 void tscrolldown(int orig, int n)
 {
 	int i;
-	Line temp;
 
 	LIMIT(n, 0, term.bot - orig + 1);
 
-	tsetdirt(orig, term.bot - n);
 	tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+	tscrolldirt(orig, -n);
 
-	for (i = term.bot; i >= orig + n; i--) {
-		temp             = term.line[i];
-		term.line[i]     = term.line[i - n];
-		term.line[i - n] = temp;
+	if (orig == 0 && term.bot == term.row - 1) {
+		trotate(-n);
+	} else {
+		for (i = term.bot; i >= orig + n; i--)
+			tswaplines(i, i - n);
 	}
 
 	selscroll(orig, n);
@@ -993,17 +1490,17 @@ void tscrolldown(int orig, int n)
 void tscrollup(int orig, int n)
 {
 	int i;
-	Line temp;
 
 	LIMIT(n, 0, term.bot - orig + 1);
 
 	tclearregion(0, orig, term.col - 1, orig + n - 1);
-	tsetdirt(orig + n, term.bot);
+	tscrolldirt(orig, n);
 
-	for (i = orig; i <= term.bot - n; i++) {
-		temp             = term.line[i];
-		term.line[i]     = term.line[i + n];
-		term.line[i + n] = temp;
+	if (orig == 0 && term.bot == term.row - 1) {
+		trotate(n);
+	} else {
+		for (i = orig; i <= term.bot - n; i++)
+			tswaplines(i, i + n);
 	}
 
 	selscroll(orig, -n);
@@ -1040,39 +1537,6 @@ void tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void csiparse(void)
-{
-	char *p = csiescseq.buf, *np;
-	long int v;
-	int sep = ';'; /* colon or semi-colon, but not both */
-
-	csiescseq.narg = 0;
-	if (*p == '?') {
-		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf + csiescseq.len) {
-		if (p != csiescseq.buf && p[-1] == *p && *p == sep) {
-			p++;
-			continue; /* FIXME: this might not work actually */
-		}
-		np = NULL;
-		v  = strtol(p, &np, 10);
-		if (np == p) v = 0;
-		if (v == LONG_MAX || v == LONG_MIN) v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p                               = np;
-		if (sep == ';' && *p == ':')
-			sep = ':'; /* allow override to colon once */
-		if (*p != sep || csiescseq.narg == ESC_ARG_SIZ) break;
-		p++;
-	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf + csiescseq.len) ? *p : '\0';
-}
-
 /* for absolute user moves, when decom is set */
 void tmoveato(int x, int y)
 {
@@ -1095,7 +1559,7 @@ void tmoveto(int x, int y)
 	term.c.y = LIMIT(y, miny, maxy);
 }
 
-void tsetchar(Rune u, const Glyph *attr, int x, int y)
+Rune tgraphic0(Rune u)
 {
 	static const char *vt100_0[62] = {
 	    /* 0x41 - 0x7e */
@@ -1112,25 +1576,60 @@ void tsetchar(Rune u, const Glyph *attr, int x, int y)
 	/*
 	 * The table is proudly stolen from rxvt.
 	 */
-	if (term.trantbl[term.charset] == CS_GRAPHIC0 &&
-	    BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
+	if (BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
 		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
+	return u;
+}
+
+void tsetchar(Rune u, const Glyph *attr, int x, int y)
+{
+	if (term.trantbl[term.charset] == CS_GRAPHIC0) u = tgraphic0(u);
 
 	if (term.line[y][x].mode & ATTR_WIDE) {
 		if (x + 1 < term.col) {
 			term.line[y][x + 1].u = ' ';
 			term.line[y][x + 1].mode &= ~ATTR_WDUMMY;
+			tsetdirtcols(y, x + 1, x + 2);
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
+	} else if (term.line[y][x].mode & ATTR_WDUMMY && x > 0) {
 		term.line[y][x - 1].u = ' ';
 		term.line[y][x - 1].mode &= ~ATTR_WIDE;
+		tsetdirtcols(y, x - 1, x);
 	}
 
-	term.dirty[y]     = 1;
+	tsetdirtcols(y, x, x + 1);
 	term.line[y][x]   = *attr;
 	term.line[y][x].u = u;
 }
 
+/*
+ * Same as tsetchar() on each of n single width runes from x on, which must
+ * fit in the line. Wide chars can only be cut in two at the edges.
+ */
+void tsetchars(const Rune *u, int n, const Glyph *attr, int x, int y)
+{
+	Glyph *line = term.line[y];
+	int g0 = term.trantbl[term.charset] == CS_GRAPHIC0;
+	int i, x1 = x, x2 = x + n;
+
+	if (line[x].mode & ATTR_WDUMMY && x > 0) {
+		line[x - 1].u = ' ';
+		line[x - 1].mode &= ~ATTR_WIDE;
+		x1--;
+	}
+	if (line[x + n - 1].mode & ATTR_WIDE && x + n < term.col) {
+		line[x + n].u = ' ';
+		line[x + n].mode &= ~ATTR_WDUMMY;
+		x2++;
+	}
+
+	for (i = 0; i < n; i++) {
+		line[x + i]   = *attr;
+		line[x + i].u = g0 ? tgraphic0(u[i]) : u[i];
+	}
+	tsetdirtcols(y, x1, x2);
+}
+
 void tclearregion(int x1, int y1, int x2, int y2)
 {
 	int x, y, temp;
@@ -1145,14 +1644,20 @@ void tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y2, 0, term.row - 1);
 
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
+		tsetdirtcols(y, x1, x2 + 1);
+		if (sel.ob.x != -1 && BETWEEN(y, sel.nb.y, sel.ne.y)) {
+			for (x = x1; x <= x2; x++) {
+				if (selected(x, y)) {
+					selclear();
+					break;
+				}
+			}
+		}
 		for (x = x1; x <= x2; x++) {
 			gp = &term.line[y][x];
-			if (selected(x, y)) selclear();
-			gp->fg   = term.c.attr.fg;
-			gp->bg   = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u    = ' ';
+			gp->style = term.c.attr.style;
+			gp->mode  = 0;
+			gp->u     = ' ';
 		}
 	}
 }
@@ -1168,8 +1673,20 @@ void tdeletechar(int n)
 	src  = term.c.x + n;
 	size = term.col - src;
 	line = term.line[term.c.y];
+	if (n == 0) return;
 
+	/* a wide char cut in two is blanked */
+	if (dst > 0 && line[dst].mode & ATTR_WDUMMY) {
+		line[dst - 1].u = ' ';
+		line[dst - 1].mode &= ~ATTR_WIDE;
+		tsetdirtcols(term.c.y, dst - 1, dst);
+	}
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	if (line[dst].mode & ATTR_WDUMMY) {
+		line[dst].u = ' ';
+		line[dst].mode &= ~ATTR_WDUMMY;
+	}
+	tsetdirtcols(term.c.y, dst, term.col);
 	tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
 }
 
@@ -1184,8 +1701,24 @@ void tinsertblank(int n)
 	src  = term.c.x;
 	size = term.col - dst;
 	line = term.line[term.c.y];
+	if (n == 0) return;
 
+	/* a wide char cut in two, or pushed half off the line, is blanked */
+	if (src > 0 && line[src].mode & ATTR_WDUMMY) {
+		line[src - 1].u = ' ';
+		line[src - 1].mode &= ~ATTR_WIDE;
+		tsetdirtcols(term.c.y, src - 1, src);
+	}
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	if (dst < term.col && line[dst].mode & ATTR_WDUMMY) {
+		line[dst].u = ' ';
+		line[dst].mode &= ~ATTR_WDUMMY;
+	}
+	if (line[term.col - 1].mode & ATTR_WIDE) {
+		line[term.col - 1].u = ' ';
+		line[term.col - 1].mode &= ~ATTR_WIDE;
+	}
+	tsetdirtcols(term.c.y, src, term.col);
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1252,35 +1785,196 @@ int32_t tdefcolor(const int *attr, int *npar, int l)
 	return idx;
 }
 
-void tsetattr(const int *attr, int l)
+/*
+ * Colon separated sub-params, as in "38:2::r:g:b" or "4:3", only ever
+ * belong to the attribute they follow; the old semicolon separated color
+ * forms take the following params instead.
+ */
+int32_t tdefcolorsub(const int *sub, int n)
 {
-	int i;
+	int32_t idx = -1;
+	int r, g, b;
+
+	switch (n > 0 ? sub[0] : -1) {
+	case 2: /* direct color in RGB space, the color space id is optional */
+		if (n < 4) {
+			fprintf(stderr,
+				"erresc(38): Incorrect number of sub-params "
+				"(%d)\n",
+				n);
+			break;
+		}
+		sub += n > 4;
+		r = sub[1];
+		g = sub[2];
+		b = sub[3];
+		if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) ||
+		    !BETWEEN(b, 0, 255))
+			fprintf(stderr, "erresc: bad rgb color (%d,%d,%d)\n", r,
+				g, b);
+		else
+			idx = TRUECOLOR(r, g, b);
+		break;
+	case 5: /* indexed color */
+		if (n < 2) {
+			fprintf(stderr,
+				"erresc(38): Incorrect number of sub-params "
+				"(%d)\n",
+				n);
+			break;
+		}
+		if (!BETWEEN(sub[1], 0, 255))
+			fprintf(stderr, "erresc: bad fgcolor %d\n", sub[1]);
+		else
+			idx = sub[1];
+		break;
+	default:
+		fprintf(stderr, "erresc(38): gfx attr %d unknown\n",
+			n > 0 ? sub[0] : -1);
+		break;
+	}
+
+	return idx;
+}
+
+/*
+ * Cells only keep the id of their colors and underline style. The styles
+ * are interned, so that equal styles get the same id. Once the table is
+ * full, the styles no longer used are dropped and the ids compacted, the
+ * table only grows when that frees less than half of it.
+ */
+void styleinit(void)
+{
+	if (style) return;
+
+	stylesiz  = 64;
+	style     = xmalloc(stylesiz * sizeof(*style));
+	stylehash = xmalloc(2 * stylesiz * sizeof(*stylehash));
+	style[0]  = (Style){.fg = defaultfg, .bg = defaultbg};
+	nstyle    = 1;
+	tstylerehash();
+}
+
+const Style *tstyle(int id) { return &style[id]; }
+
+uint stylehashof(const Style *s)
+{
+	uint h = s->fg * 0x9e3779b1u;
+
+	h = (h ^ s->bg) * 0x9e3779b1u;
+	h = (h ^ s->uc) * 0x9e3779b1u;
+	return (h ^ s->us) * 0x9e3779b1u;
+}
+
+void tstylerehash(void)
+{
+	int i, h, mask = 2 * stylesiz - 1;
+
+	for (i = 0; i <= mask; i++)
+		stylehash[i] = -1;
+	for (i = 0; i < nstyle; i++) {
+		h = stylehashof(&style[i]) & mask;
+		while (stylehash[h] >= 0)
+			h = (h + 1) & mask;
+		stylehash[h] = i;
+	}
+}
+
+/* drops the styles no cell or cursor refers to and renumbers the rest */
+void tstylecompact(void)
+{
+	int *map = xmalloc(nstyle * sizeof(*map));
+	Glyph *gp, *end;
+	int i, n;
+
+	memset(map, 0, nstyle * sizeof(*map));
+	map[0] = 1;
+	for (i = 0; i < 2; i++) {
+		end = term.scr[i].cells + term.row * term.col;
+		for (gp = term.scr[i].cells; gp < end; gp++)
+			map[gp->style] = 1;
+	}
+	map[term.c.attr.style] = map[term.sc[0].attr.style] =
+	    map[term.sc[1].attr.style] = 1;
+
+	for (i = n = 0; i < nstyle; i++) {
+		if (map[i]) {
+			style[n] = style[i];
+			map[i]   = n++;
+		}
+	}
+	nstyle = n;
+
+	for (i = 0; i < 2; i++) {
+		end = term.scr[i].cells + term.row * term.col;
+		for (gp = term.scr[i].cells; gp < end; gp++)
+			gp->style = map[gp->style];
+	}
+	term.c.attr.style     = map[term.c.attr.style];
+	term.sc[0].attr.style = map[term.sc[0].attr.style];
+	term.sc[1].attr.style = map[term.sc[1].attr.style];
+	free(map);
+}
+
+ushort tstyleid(const Style *s)
+{
+	int h, id, mask = 2 * stylesiz - 1;
+
+	for (h = stylehashof(s) & mask; (id = stylehash[h]) >= 0;
+	     h = (h + 1) & mask) {
+		if (style[id].fg == s->fg && style[id].bg == s->bg &&
+		    style[id].uc == s->uc && style[id].us == s->us)
+			return id;
+	}
+	if (nstyle < stylesiz) {
+		style[nstyle] = *s;
+		stylehash[h]  = nstyle;
+		return nstyle++;
+	}
+
+	tstylecompact();
+	if (nstyle > stylesiz / 2 && stylesiz < STYLE_MAX) {
+		stylesiz *= 2;
+		style     = xrealloc(style, stylesiz * sizeof(*style));
+		stylehash = xrealloc(stylehash,
+				     2 * stylesiz * sizeof(*stylehash));
+	}
+	tstylerehash();
+	/* every id is on screen, which takes more than STYLE_MAX cells */
+	if (nstyle == stylesiz) return 0;
+	return tstyleid(s);
+}
+
+void tsetattr(const CSIEscape *csi)
+{
+	const int *attr = csi->arg, *sub;
+	int i, l = csi->narg, nsub;
 	int32_t idx;
+	Style st = *tstyle(term.c.attr.style);
 
 	for (i = 0; i < l; i++) {
+		sub  = csi->sub[i];
+		nsub = MIN(csi->nsub[i], ESC_SUB_SIZ);
 		switch (attr[i]) {
 		case 0:
 			term.c.attr.mode &= ATTR_WRAP | ATTR_WIDE | ATTR_WDUMMY;
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
-			term.c.attr.us = UNDERLINE_NONE;
+			st.fg = defaultfg;
+			st.bg = defaultbg;
+			st.us = UNDERLINE_NONE;
 			break;
 		case 1: term.c.attr.mode |= ATTR_BOLD; break;
 		case 2: term.c.attr.mode |= ATTR_FAINT; break;
 		case 3: term.c.attr.mode |= ATTR_ITALIC; break;
 		case 4:
-			if (csiescseq.narg == 2) {
-				if (csiescseq.arg[1] == UNDERLINE_NONE) {
-					term.c.attr.mode &= ~ATTR_UNDERLINE;
-					term.c.attr.us = UNDERLINE_SINGLE;
-				} else {
-					term.c.attr.mode |= ATTR_UNDERLINE;
-					term.c.attr.us = csiescseq.arg[1];
-				}
-				i++;
+			if (nsub && sub[0] == UNDERLINE_NONE) {
+				term.c.attr.mode &= ~ATTR_UNDERLINE;
+				st.us = UNDERLINE_SINGLE;
+			} else if (nsub && sub[0] <= UNDERLINE_DASHED) {
+				term.c.attr.mode |= ATTR_UNDERLINE;
+				st.us = sub[0];
 			} else {
 				term.c.attr.mode |= ATTR_UNDERLINE;
-				term.c.attr.us = UNDERLINE_SINGLE;
+				st.us = UNDERLINE_SINGLE;
 			}
 			break;
 		case 5: /* slow blink */
@@ -1293,13 +1987,13 @@ void tsetattr(const int *attr, int l)
 		/*   20  fraktur (gothic) */
 		case 21:
 			term.c.attr.mode |= ATTR_UNDERLINE;
-			term.c.attr.us = UNDERLINE_DOUBLE;
+			st.us = UNDERLINE_DOUBLE;
 			break;
 		case 22: term.c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT); break;
 		case 23: term.c.attr.mode &= ~ATTR_ITALIC; break;
 		case 24:
 			term.c.attr.mode &= ~ATTR_UNDERLINE;
-			term.c.attr.us = UNDERLINE_SINGLE;
+			st.us = UNDERLINE_SINGLE;
 			break;
 		case 25: term.c.attr.mode &= ~ATTR_BLINK; break;
 		/*   26  proportional spacing */
@@ -1313,12 +2007,13 @@ void tsetattr(const int *attr, int l)
 		case 34:
 		case 35:
 		case 36:
-		case 37: term.c.attr.fg = attr[i] - 30; break;
+		case 37: st.fg = attr[i] - 30; break;
 		case 38:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = idx;
+			if ((idx = nsub ? tdefcolorsub(sub, nsub)
+					: tdefcolor(attr, &i, l)) >= 0)
+				st.fg = idx;
 			break;
-		case 39: term.c.attr.fg = defaultfg; break;
+		case 39: st.fg = defaultfg; break;
 		case 40:
 		case 41:
 		case 42:
@@ -1326,12 +2021,13 @@ void tsetattr(const int *attr, int l)
 		case 44:
 		case 45:
 		case 46:
-		case 47: term.c.attr.bg = attr[i] - 40; break;
+		case 47: st.bg = attr[i] - 40; break;
 		case 48:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = idx;
+			if ((idx = nsub ? tdefcolorsub(sub, nsub)
+					: tdefcolor(attr, &i, l)) >= 0)
+				st.bg = idx;
 			break;
-		case 49: term.c.attr.bg = defaultbg; break;
+		case 49: st.bg = defaultbg; break;
 		/*   50  disable proportional spacing */
 		/*   51  framed */
 		/*   52  encircled */
@@ -1341,8 +2037,9 @@ void tsetattr(const int *attr, int l)
 		/*   56  nothing */
 		/*   57  nothing */
 		case 58:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0) {
-				term.c.attr.uc = idx;
+			if ((idx = nsub ? tdefcolorsub(sub, nsub)
+					: tdefcolor(attr, &i, l)) >= 0) {
+				st.uc = idx;
 				term.c.attr.mode |= ATTR_COLORED_UNDERLINE;
 			}
 			break;
@@ -1384,7 +2081,7 @@ void tsetattr(const int *attr, int l)
 		case 94:
 		case 95:
 		case 96:
-		case 97:  term.c.attr.fg = attr[i] - 90 + 8; break;
+		case 97:  st.fg = attr[i] - 90 + 8; break;
 		/*   98  nothing */
 		/*   99  nothing */
 		case 100:
@@ -1394,12 +2091,13 @@ void tsetattr(const int *attr, int l)
 		case 104:
 		case 105:
 		case 106:
-		case 107: term.c.attr.bg = attr[i] - 100 + 8; break;
+		case 107: st.bg = attr[i] - 100 + 8; break;
 		default:
 			warn("erresc(default): gfx attr %d unknown", attr[i]);
 			csidump();
 		}
 	}
+	term.c.attr.style = tstyleid(&st);
 }
 
 void tsetscroll(int t, int b)
@@ -1580,9 +2278,19 @@ void csihandle(void)
 		break;
 	case 'b': /* REP -- if last char is printable print it <n> more times */
 		LIMIT(csiescseq.arg[0], 1, 65535);
-		if (term.lastc)
+		if (term.lastc && !IS_SET(MODE_INSERT) &&
+		    tnarrowrun(&term.lastc, 1)) {
+			Rune u[MIN(csiescseq.arg[0], term.col)];
+			int i;
+
+			for (i = 0; i < (int)LEN(u); i++)
+				u[i] = term.lastc;
+			for (i = csiescseq.arg[0]; i > 0; i -= LEN(u))
+				tputrunes(u, MIN(i, (int)LEN(u)));
+		} else if (term.lastc) {
 			while (csiescseq.arg[0]-- > 0)
 				tputc(term.lastc);
+		}
 		break;
 	case 'C': /* CUF -- Cursor <n> Forward */
 	case 'a': /* HPR -- Cursor <n> Forward */
@@ -1703,7 +2411,7 @@ void csihandle(void)
 		tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
 		break;
 	case 'm': /* SGR -- Terminal attribute (color) */
-		tsetattr(csiescseq.arg, csiescseq.narg);
+		tsetattr(&csiescseq);
 		break;
 	case 'n': /* DSR -- Device Status Report */
 		switch (csiescseq.arg[0]) {
@@ -1772,7 +2480,86 @@ void csidump(void)
 	putc('\n', stderr);
 }
 
-void csireset(void) { memset(&csiescseq, 0, sizeof(csiescseq)); }
+void csireset(void)
+{
+	memset(csiescseq.arg, 0, sizeof(csiescseq.arg));
+	memset(csiescseq.nsub, 0, sizeof(csiescseq.nsub));
+	csiescseq.len  = 0;
+	csiescseq.priv = 0;
+	csiescseq.narg = 0;
+	csiescseq.mode[0] = csiescseq.mode[1] = '\0';
+}
+
+void escset(int state, int lo, int hi, int action, int next)
+{
+	for (; lo <= hi; lo++)
+		esctbl[state][lo] = action << 4 | next;
+}
+
+void escinit(void)
+{
+	int s;
+
+	/* controls are executed without leaving the sequence */
+	for (s = 0; s < ESC_NSTATES; s++) {
+		escset(s, 0x00, 0x1F, ACT_EXEC, s);
+		escset(s, 0x7F, 0x7F, ACT_EXEC, s);
+		escset(s, CLS_HIGH, CLS_HIGH, ACT_NONE, ESC_GROUND);
+		escset(s, CLS_C1UTF8, CLS_C1UTF8, ACT_NONE, s);
+	}
+
+	escset(ESC_GROUND, 0x20, 0x7E, ACT_PRINT, ESC_GROUND);
+	escset(ESC_GROUND, CLS_HIGH, CLS_HIGH, ACT_PRINT, ESC_GROUND);
+
+	escset(ESC_START, 0x20, 0x7E, ACT_ESC, ESC_GROUND);
+	escset(ESC_START, '[', '[', ACT_NONE, ESC_CSI);
+	escset(ESC_START, '#', '#', ACT_NONE, ESC_TEST);
+	escset(ESC_START, '%', '%', ACT_NONE, ESC_UTF8);
+	escset(ESC_START, '(', '+', ACT_ESC, ESC_ALTCHARSET);
+	escset(ESC_START, 'P', 'P', ACT_ESC, ESC_STR);
+	escset(ESC_START, ']', '_', ACT_ESC, ESC_STR);
+	escset(ESC_START, 'k', 'k', ACT_ESC, ESC_STR);
+
+	escset(ESC_ALTCHARSET, 0x20, 0x7E, ACT_CHARSET, ESC_GROUND);
+	escset(ESC_TEST, 0x20, 0x7E, ACT_TEST, ESC_GROUND);
+	escset(ESC_UTF8, 0x20, 0x7E, ACT_UTF8, ESC_GROUND);
+
+	for (s = ESC_CSI; s <= ESC_CSI_IGNORE; s++) {
+		escset(s, 0x20, 0x2F, ACT_COLLECT, ESC_CSI_INTER);
+		escset(s, 0x30, 0x3F, ACT_NONE, ESC_CSI_IGNORE);
+		escset(s, 0x40, 0x7E, ACT_CSI, ESC_GROUND);
+		escset(s, CLS_HIGH, CLS_HIGH, ACT_NONE, ESC_CSI_IGNORE);
+	}
+	/* colons separate parameters as well, private markers come first */
+	escset(ESC_CSI, 0x30, 0x3B, ACT_PARAM, ESC_CSI_PARAM);
+	escset(ESC_CSI, 0x3C, 0x3F, ACT_COLLECT, ESC_CSI_PARAM);
+	escset(ESC_CSI_PARAM, 0x30, 0x3B, ACT_PARAM, ESC_CSI_PARAM);
+	escset(ESC_CSI_IGNORE, 0x20, 0x3F, ACT_NONE, ESC_CSI_IGNORE);
+	escset(ESC_CSI_IGNORE, 0x40, 0x7E, ACT_NONE, ESC_GROUND);
+
+	escset(ESC_STR, 0x00, 0x7F, ACT_STRPUT, ESC_STR);
+	escset(ESC_STR, CLS_HIGH, CLS_HIGH, ACT_STRPUT, ESC_STR);
+	escset(ESC_STR, '\a', '\a', ACT_STREND, ESC_GROUND);
+	escset(ESC_STR, CLS_C1UTF8, CLS_C1UTF8, ACT_NONE, ESC_GROUND);
+
+	memcpy(esctbl[ESC_STR_END], esctbl[ESC_START], CLS_NUM);
+	escset(ESC_STR_END, '\a', '\a', ACT_STREND, ESC_START);
+	escset(ESC_STR_END, '\\', '\\', ACT_STREND, ESC_GROUND);
+
+	/* these interrupt any sequence */
+	for (s = 0; s < ESC_NSTATES; s++) {
+		escset(s, '\030', '\030', ACT_EXEC, ESC_GROUND);
+		escset(s, '\032', '\032', ACT_EXEC, ESC_GROUND);
+		escset(s, '\033', '\033', ACT_CLEAR,
+		       s == ESC_STR ? ESC_STR_END : ESC_START);
+		escset(s, 0x80, 0x9F, ACT_EXEC, ESC_GROUND);
+		escset(s, 0x90, 0x90, ACT_EXEC, ESC_STR);
+		escset(s, 0x9B, 0x9B, ACT_CLEAR, ESC_CSI);
+		escset(s, 0x9C, 0x9C, s == ESC_STR ? ACT_STREND : ACT_NONE,
+		       ESC_GROUND);
+		escset(s, 0x9D, 0x9F, ACT_EXEC, ESC_STR);
+	}
+}
 
 void osc_color_response(int num, int index, int is_osc4)
 {
@@ -1811,7 +2598,6 @@ void strhandle(void)
 	    {defaultcs, "cursor"    }
         };
 
-	term.esc &= ~(ESC_STR_END | ESC_STR);
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1959,7 +2745,7 @@ void sendbreak(const Arg *arg)
 	if (tcsendbreak(cmdfd, 0)) perror("Error sending break");
 }
 
-void tprinter(char *s, size_t len)
+void tprinter(const char *s, size_t len)
 {
 	if (iofd != -1 && xwrite(iofd, s, len) < 0) {
 		perror("Error writing to output file");
@@ -2057,13 +2843,14 @@ void tdeftran(char ascii)
 
 void tdectest(char c)
 {
+	Rune u[term.col];
 	int x, y;
 
 	if (c == '8') { /* DEC screen alignment test. */
-		for (x = 0; x < term.col; ++x) {
-			for (y = 0; y < term.row; ++y)
-				tsetchar('E', &term.c.attr, x, y);
-		}
+		for (x = 0; x < term.col; ++x)
+			u[x] = 'E';
+		for (y = 0; y < term.row; ++y)
+			tsetchars(u, term.col, &term.c.attr, 0, y);
 	}
 }
 
@@ -2077,7 +2864,6 @@ void tstrsequence(uchar c)
 	}
 	strreset();
 	strescseq.type = c;
-	term.esc |= ESC_STR;
 }
 
 void tcontrolcode(uchar ascii)
@@ -2092,19 +2878,7 @@ void tcontrolcode(uchar ascii)
 		/* go to first col if the mode is set */
 		tnewline(IS_SET(MODE_CRLF));
 		return;
-	case '\a': /* BEL */
-		if (term.esc & ESC_STR_END) {
-			/* backwards compatibility to xterm */
-			strhandle();
-		} else {
-			xbell();
-		}
-		break;
-	case '\033': /* ESC */
-		csireset();
-		term.esc &= ~(ESC_CSI | ESC_ALTCHARSET | ESC_TEST);
-		term.esc |= ESC_START;
-		return;
+	case '\a': /* BEL */ xbell(); return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
 		term.charset = 1 - (ascii - '\016');
@@ -2112,7 +2886,7 @@ void tcontrolcode(uchar ascii)
 	case '\032': /* SUB */
 		tsetchar('?', &term.c.attr, term.c.x, term.c.y);
 		/* FALLTHROUGH */
-	case '\030': /* CAN */ csireset(); break;
+	case '\030': /* CAN */ return;
 	case '\005': /* ENQ (IGNORED) */
 	case '\000': /* NUL (IGNORED) */
 	case '\021': /* XON (IGNORED) */
@@ -2150,8 +2924,6 @@ void tcontrolcode(uchar ascii)
 	case 0x9a: /* DECID -- Identify Terminal */
 		ttywrite(vtiden, strlen(vtiden), 0);
 		break;
-	case 0x9b: /* TODO: CSI */
-	case 0x9c: /* TODO: ST */ break;
 	case 0x90: /* DCS -- Device Control String */
 	case 0x9d: /* OSC -- Operating System Command */
 	case 0x9e: /* PM -- Privacy Message */
@@ -2159,27 +2931,19 @@ void tcontrolcode(uchar ascii)
 		tstrsequence(ascii);
 		return;
 	}
-	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term.esc &= ~(ESC_STR_END | ESC_STR);
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int eschandle(uchar ascii)
+/* final character of an escape sequence, CSI and strings aside */
+void eschandle(uchar ascii)
 {
 	switch (ascii) {
-	case '[': term.esc |= ESC_CSI; return 0;
-	case '#': term.esc |= ESC_TEST; return 0;
-	case '%': term.esc |= ESC_UTF8; return 0;
 	case 'P': /* DCS -- Device Control String */
 	case '_': /* APC -- Application Program Command */
 	case '^': /* PM -- Privacy Message */
 	case ']': /* OSC -- Operating System Command */
 	case 'k': /* old title set compatibility */
 		tstrsequence(ascii);
-		return 0;
+		break;
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
 		term.charset = 2 + (ascii - 'n');
@@ -2189,8 +2953,7 @@ int eschandle(uchar ascii)
 	case '*': /* G2D4 -- set tertiary charset G2 */
 	case '+': /* G3D4 -- set quaternary charset G3 */
 		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
+		break;
 	case 'D': /* IND -- Linefeed */
 		if (term.c.y == term.bot) {
 			tscrollup(term.top, 1);
@@ -2228,49 +2991,96 @@ int eschandle(uchar ascii)
 		break;
 	case '7': /* DECSC -- Save Cursor */ tcursor(CURSOR_SAVE); break;
 	case '8': /* DECRC -- Restore Cursor */ tcursor(CURSOR_LOAD); break;
-	case '\\': /* ST -- String Terminator */
-		if (term.esc & ESC_STR_END) strhandle();
-		break;
+	case '\\': /* ST -- String Terminator, without a string */ break;
 	default:
 		fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
 			(uchar)ascii, isprint(ascii) ? ascii : '.');
 		break;
 	}
-	return 1;
 }
 
 void tputc(Rune u)
 {
 	char c[UTF_SIZ];
 	int control;
-	int width, len;
+	int width, len, t, *a, *n;
 	Glyph *gp;
 
 	control = ISCONTROL((int_least32_t)u);
 	if (u < 127 || !IS_SET(MODE_UTF8)) {
-		c[0]  = u;
-		width = len = 1;
+		c[0] = u;
+		len  = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1) width = 1;
 	}
 
 	if (IS_SET(MODE_PRINT)) tprinter(c, len);
 
+	if (!term.esc && !control) goto print;
+
 	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
+	 * Everything else goes through the transition table. Control codes
+	 * are acted on as soon as they arrive, even inside a sequence, and
+	 * only CAN, SUB, ESC and C1 controls interrupt one.
 	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		    ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START | ESC_STR);
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
+	if (u < 0x80)
+		t = esctbl[term.esc][u];
+	else if (u < 0xA0)
+		t = esctbl[term.esc][IS_SET(MODE_UTF8) ? CLS_C1UTF8 : u];
+	else
+		t = esctbl[term.esc][CLS_HIGH];
+	term.esc = t & 0xF;
+
+	/* the raw CSI string is only kept for csidump() */
+	if (BETWEEN(t >> 4, ACT_COLLECT, ACT_CSI) &&
+	    csiescseq.len < sizeof(csiescseq.buf))
+		csiescseq.buf[csiescseq.len++] = u;
+
+	switch (t >> 4) {
+	case ACT_PRINT: goto print;
+	case ACT_EXEC:
+		tcontrolcode(u);
+		/* control codes are not shown ever */
+		if (!term.esc) term.lastc = 0;
+		break;
+	case ACT_CLEAR: csireset(); break;
+	case ACT_COLLECT:
+		if (u == '?')
+			csiescseq.priv = 1;
+		else if (!csiescseq.mode[0])
+			csiescseq.mode[0] = u;
+		else if (!csiescseq.mode[1])
+			csiescseq.mode[1] = u;
+		break;
+	case ACT_PARAM:
+		if (csiescseq.narg == ESC_ARG_SIZ) break;
+		n = &csiescseq.nsub[csiescseq.narg];
+		if (u == ';') {
+			csiescseq.narg++;
+		} else if (u == ':') {
+			/* sub-params past the limit are counted and dropped */
+			if (*n < ESC_SUB_SIZ)
+				csiescseq.sub[csiescseq.narg][*n] = 0;
+			if (*n <= ESC_SUB_SIZ) (*n)++;
+		} else if (*n <= ESC_SUB_SIZ) {
+			a  = *n ? &csiescseq.sub[csiescseq.narg][*n - 1]
+				: &csiescseq.arg[csiescseq.narg];
+			*a = MIN(*a * 10 + (int)(u - '0'), ESC_ARG_MAX);
 		}
-
+		break;
+	case ACT_CSI:
+		if (!csiescseq.mode[0])
+			csiescseq.mode[0] = u;
+		else if (!csiescseq.mode[1])
+			csiescseq.mode[1] = u;
+		csiescseq.narg = MIN(csiescseq.narg + 1, ESC_ARG_SIZ);
+		csihandle();
+		break;
+	case ACT_ESC: eschandle(u); break;
+	case ACT_CHARSET: tdeftran(u); break;
+	case ACT_TEST: tdectest(u); break;
+	case ACT_UTF8: tdefutf8(u); break;
+	case ACT_STRPUT:
 		if (strescseq.len + len >= strescseq.siz) {
 			/*
 			 * Here is a bug in terminals. If the user never sends
@@ -2292,51 +3102,20 @@ void tputc(Rune u)
 
 		memmove(&strescseq.buf[strescseq.len], c, len);
 		strescseq.len += len;
-		return;
+		break;
+	case ACT_STREND:
+		strhandle();
+		if (control) term.lastc = 0;
+		break;
 	}
-
-check_control_code:
 	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
+	 * All characters which form part of a sequence are not
+	 * printed
 	 */
-	if (control) {
-		/* in UTF-8 mode ignore handling C1 control characters */
-		if (IS_SET(MODE_UTF8) && ISCONTROLC1(u)) return;
-		tcontrolcode(u);
-		/*
-		 * control codes are not shown ever
-		 */
-		if (!term.esc) term.lastc = 0;
-		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E) ||
-			    csiescseq.len >= sizeof(csiescseq.buf) - 1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
-		} else if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
-		} else {
-			if (!eschandle(u)) return;
-			/* sequence already finished */
-		}
-		term.esc = 0;
-		/*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
-		return;
-	}
+	return;
+
+print:
+	width = u < 127 || !IS_SET(MODE_UTF8) ? 1 : runewidth(u);
 	if (selected(term.c.x, term.c.y)) selclear();
 
 	gp = &term.line[term.c.y][term.c.x];
@@ -2350,6 +3129,7 @@ check_control_code:
 		memmove(gp + width, gp,
 			(term.col - term.c.x - width) * sizeof(Glyph));
 		gp->mode &= ~ATTR_WIDE;
+		tsetdirtcols(term.c.y, term.c.x, term.col);
 	}
 
 	if (term.c.x + width > term.col) {
@@ -2373,6 +3153,8 @@ check_control_code:
 			}
 			gp[1].u    = '\0';
 			gp[1].mode = ATTR_WDUMMY;
+			tsetdirtcols(term.c.y, term.c.x + 1,
+				     MIN(term.c.x + 3, term.col));
 		}
 	}
 	if (term.c.x + width < term.col) {
@@ -2382,14 +3164,132 @@ check_control_code:
 	}
 }
 
+/*
+ * Bulk version of tputc() for a run of printable ASCII outside of any
+ * sequence. The run is written one line segment at a time, so wrapping and
+ * the wide character fixups only happen at the segment edges.
+ */
+void tputascii(const char *s, int n)
+{
+	Rune u[256];
+	int len;
+
+	for (; n > 0; s += len, n -= len) {
+		len = MIN(n, (int)LEN(u));
+		asciiwiden(s, len, u);
+		tputrunes(u, len);
+	}
+}
+
+/* length of the leading run of printable single width runes */
+int tnarrowrun(const Rune *u, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (u[i] < 0x20 || u[i] == 0x7f || ISCONTROLC1(u[i])) break;
+		if (u[i] > 0x7f && IS_SET(MODE_UTF8) && runewidth(u[i]) != 1)
+			break;
+	}
+	return i;
+}
+
+/*
+ * Prints a run of printable single width runes as tputc() would, a line
+ * at a time. Insert mode is left to tputc().
+ */
+void tputrunes(const Rune *u, int n)
+{
+	char buf[BUFSIZ];
+	int i, x, y, len;
+	size_t nb = 0;
+
+	/* the whole run in as few writes as fit in buf */
+	if (IS_SET(MODE_PRINT)) {
+		for (i = 0; i < n; i++) {
+			if (nb + UTF_SIZ > sizeof(buf)) {
+				tprinter(buf, nb);
+				nb = 0;
+			}
+			if (IS_SET(MODE_UTF8))
+				nb += utf8encode(u[i], buf + nb);
+			else
+				buf[nb++] = u[i];
+		}
+		if (nb > 0) tprinter(buf, nb);
+	}
+
+	while (n > 0) {
+		if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
+			tnewline(1);
+		} else if (!IS_SET(MODE_WRAP) && term.c.x == term.col - 1) {
+			/* everything but the last char is overwritten */
+			u += n - 1;
+			n = 1;
+		}
+
+		x   = term.c.x;
+		y   = term.c.y;
+		len = MIN(n, term.col - x);
+
+		if (sel.ob.x != -1 && BETWEEN(y, sel.nb.y, sel.ne.y)) {
+			for (i = x; i < x + len; i++) {
+				if (selected(i, y)) {
+					selclear();
+					break;
+				}
+			}
+		}
+
+		tsetchars(u, len, &term.c.attr, x, y);
+		term.lastc = u[len - 1];
+
+		u += len;
+		n -= len;
+		if (x + len < term.col) {
+			tmoveto(x + len, y);
+		} else {
+			tmoveto(term.col - 1, y);
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
+	}
+}
+
 int twrite(const char *buf, int buflen, int show_ctrl)
 {
-	int charsize;
+	static Rune runes[BUFSIZ];
+	size_t i, nr;
+	int charsize, len;
 	Rune u;
 	int n;
 
 	for (n = 0; n < buflen; n += charsize) {
-		if (IS_SET(MODE_UTF8)) {
+		if (!show_ctrl && !term.esc && !IS_SET(MODE_INSERT) &&
+		    BETWEEN((uchar)buf[n], 0x20, 0x7e)) {
+			charsize = asciirun(buf + n, buflen - n);
+			tputascii(buf + n, charsize);
+			continue;
+		}
+		if (!show_ctrl && !term.esc && IS_SET(MODE_UTF8) &&
+		    (uchar)buf[n] >= 0x80) {
+			charsize = utf8decodeblock(
+			    buf + n, MIN(buflen - n, (int)LEN(runes)), runes, &nr);
+			for (i = 0; i < nr; i += len) {
+				len = term.esc || IS_SET(MODE_INSERT)
+					  ? 0
+					  : tnarrowrun(runes + i, nr - i);
+				if (len > 0) {
+					tputrunes(runes + i, len);
+				} else {
+					tputc(runes[i]);
+					len = 1;
+				}
+			}
+			if (charsize == 0) break;
+			continue;
+		}
+		if (IS_SET(MODE_UTF8) && (uchar)buf[n] >= 0x80) {
 			/* process a complete utf8 char */
 			charsize = utf8decode(buf + n, &u, buflen - n);
 			if (charsize == 0) break;
@@ -2415,21 +3315,46 @@ int twrite(const char *buf, int buflen, int show_ctrl)
 void tfree(void)
 {
 	int i;
-	for (i = 0; i <= term.c.y; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-	}
-	for (; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-	}
 
-	free(term.line);
-	free(term.alt);
+	for (i = 0; i < 2; i++) {
+		free(term.scr[i].cells);
+		free(term.scr[i].ring);
+	}
+	free(style);
+	free(stylehash);
+	/* styleinit() starts over */
+	style     = NULL;
+	stylehash = NULL;
+	nstyle = stylesiz = 0;
 	free(term.dirty);
 	free(term.tabs);
 }
 
+/*
+ * Moves a screen into a new arena of col * row cells, dropping its first
+ * skip rows. Cells that are not copied are left for the caller to clear.
+ */
+void tresizescreen(Screen *s, int col, int row, int skip)
+{
+	Glyph *cells = xmalloc(row * col * sizeof(Glyph));
+	Line *ring   = xmalloc(2 * row * sizeof(Line));
+	int i, minrow = MIN(row, term.row), mincol = MIN(col, term.col);
+
+	for (i = 0; i < row; i++) {
+		ring[i] = ring[row + i] = cells + i * col;
+		if (i < minrow) {
+			memcpy(ring[i], s->ring[s->head + skip + i],
+			       mincol * sizeof(Glyph));
+		}
+	}
+
+	free(s->cells);
+	free(s->ring);
+	s->cells = cells;
+	s->ring  = ring;
+	s->head  = 0;
+}
+
 void tresize(int col, int row)
 {
 	int i;
@@ -2443,42 +3368,15 @@ void tresize(int col, int row)
 		return;
 	}
 
-	/*
-	 * slide screen to keep cursor where we expect it -
-	 * tscrollup would work here, but we can optimize to
-	 * memmove because we're freeing the earlier lines
-	 */
-	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-	}
-	/* ensure that both src and dst are not NULL */
-	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
-	}
-	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-	}
+	/* slide screen to keep cursor where we expect it */
+	for (i = 0; i < 2; i++)
+		tresizescreen(&term.scr[i], col, row, MAX(term.c.y - row + 1, 0));
+	term.line = term.scr[0].ring;
+	term.alt  = term.scr[1].ring;
 
-	/* resize to new height */
-	term.line  = xrealloc(term.line, row * sizeof(Line));
-	term.alt   = xrealloc(term.alt, row * sizeof(Line));
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
 	term.tabs  = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
-	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i], col * sizeof(Glyph));
-	}
-
-	/* allocate any new rows */
-	for (/* i = minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i]  = xmalloc(col * sizeof(Glyph));
-	}
 	if (col > term.col) {
 		bp = term.tabs + term.col;
 
@@ -2514,22 +3412,50 @@ void resettitle(void) { xsettitle(NULL); }
 
 void drawregion(int x1, int y1, int x2, int y2)
 {
-	int y;
+	int y, dx1, dx2;
+	Line line;
 
 	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y]) continue;
-
-		term.dirty[y] = 0;
-		xdrawline(term.line[y], x1, y, x2);
+		dx1  = MAX(term.dirty[y].x1, x1);
+		dx2  = MIN(term.dirty[y].x2, x2);
+		line = term.line[y];
+		if (dx1 >= dx2) continue;
+
+		term.dirty[y] = (Span){0, 0};
+		/* the glyphs next to it can reach into it, so they go with it */
+		if (dx1 > x1 && !ISBLANK(line[dx1 - 1])) dx1--;
+		if (dx2 < x2 && !ISBLANK(line[dx2])) dx2++;
+		/* a wide char is drawn from its first column, and whole */
+		if (dx1 > x1 && line[dx1].mode & ATTR_WDUMMY) dx1--;
+		if (dx2 < x2 && line[dx2 - 1].mode & ATTR_WIDE) dx2++;
+#ifdef LIGATURES
+		/* the text is shaped in runs of the same font */
+		while (dx1 > x1 && !((line[dx1 - 1].mode ^ line[dx1].mode) &
+				     (ATTR_BOLD | ATTR_ITALIC | ATTR_WDUMMY)))
+			dx1--;
+		while (dx2 < x2 && !((line[dx2 - 1].mode ^ line[dx2].mode) &
+				     (ATTR_BOLD | ATTR_ITALIC | ATTR_WDUMMY)))
+			dx2++;
+#endif
+		xdrawline(line, dx1, y, dx2);
 	}
 }
 
 void draw(void)
 {
-	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy, i;
+	Scroll *s;
 
 	if (!xstartdraw()) return;
 
+	/* move what is drawn, only the lines it exposed are dirty */
+	for (i = 0; i < term.nscroll; i++) {
+		s = &term.scroll[i];
+		if (s->n != 0 && abs(s->n) <= s->bot - s->top)
+			xscroll(s->top, s->bot, s->n);
+	}
+	term.nscroll = 0;
+
 	/* adjust cursor position */
 	LIMIT(term.ocx, 0, term.col - 1);
 	LIMIT(term.ocy, 0, term.row - 1);
@@ -11,8 +11,7 @@
 #define DIVCEIL(n, d)    (((n) + ((d) - 1)) / (d))
 #define DEFAULT(a, b)    (a) = (a) ? (a) : (b)
 #define LIMIT(x, a, b)   (x) = (x)<(a) ? (a) : (x)>(b) ? (b) : (x)
-#define ATTRCMP(a, b)                                                          \
-	((a).mode != (b).mode || (a).fg != (b).fg || (a).bg != (b).bg)
+#define ATTRCMP(a, b) ((a).mode != (b).mode || (a).style != (b).style)
 #define TIMEDIFF(t1, t2)                                                       \
 	((t1.tv_sec - t2.tv_sec) * 1000 + (t1.tv_nsec - t2.tv_nsec) / 1E6)
 #define MODBIT(x, set, bit) ((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
@@ -59,14 +58,18 @@ typedef unsigned short ushort;
 
 typedef uint_least32_t Rune;
 
-#define Glyph Glyph_
 typedef struct {
-	Rune u;      /* character code */
-	ushort mode; /* attribute flags */
 	uint32_t fg; /* foreground  */
 	uint32_t bg; /* background  */
 	uint32_t uc; /* underline color */
 	unsigned us; /* underline style */
+} Style;
+
+#define Glyph Glyph_
+typedef struct {
+	Rune u;       /* character code */
+	ushort mode;  /* attribute flags */
+	ushort style; /* colors and underline style, see tstyle() */
 } Glyph;
 
 typedef Glyph *Line;
@@ -93,6 +96,7 @@ void tfree(void);
 void tnew(int, int);
 void tresize(int, int);
 void tsetdirtattr(int);
+const Style *tstyle(int);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
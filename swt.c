@@ -27,6 +27,8 @@
 
 char *argv0;
 #include "arg.h"
+#include "blit.h"
+#include "boxdraw.h"
 #include "bufpool.h"
 #include "st.h"
 #include "util.h"
@@ -97,13 +99,17 @@ static void changealpha(const Arg *);
 #define TRUERED(x)   (((x) & 0xff0000) >> 8)
 #define TRUEGREEN(x) (((x) & 0xff00))
 #define TRUEBLUE(x)  (((x) & 0xff) << 8)
-#define GETPIXMANCOLOR(c)                                                      \
-	(pixman_color_t *)(IS_TRUECOL(c)                                       \
-			       ? &(pixman_color_t){TRUERED(c), TRUEGREEN(c),   \
-						   TRUEBLUE(c), 0xFFFF}        \
-			       : &(pixman_color_t){                            \
-				     dc.col[c].red, dc.col[c].green,           \
-				     dc.col[c].blue, dc.col[c].alpha})
+#define FILLCACHE    32
+#define TILEHASH     1024
+#define GLYPHMAP     512
+#define RUNHASH      256
+
+/* cells are shaped together while they have the same font, a wide glyph
+ * with the dummy cell after it */
+#define RUNMODE(l, x)                                                          \
+	((l)[(x) - ((x) > 0 && (l)[x].mode & ATTR_WDUMMY)].mode &              \
+	 (ATTR_BOLD | ATTR_ITALIC))
+#define FONTIDX(m)   (!!((m) & ATTR_BOLD) + !!((m) & ATTR_ITALIC) * 2)
 
 /* Purely graphic info */
 typedef struct {
@@ -166,7 +172,9 @@ struct swt {
 	pid_t pid;
 
 	BufPool pool;
+	DrwBuf *buf; /* buffer being drawn */
 	pixman_image_t *pix;
+	pixman_region32_t damage; /* pixels drawn since the last commit */
 
 	struct {
 		int display;
@@ -177,15 +185,99 @@ struct swt {
 
 	bool running   : 1;
 	bool need_draw : 1;
+	bool need_buf  : 1; /* a draw waits for a buffer to be released */
+};
+
+/* a color, with its solid fill once it was needed */
+typedef struct {
+	pixman_color_t c;
+	pixman_image_t *fill;
+	uint32_t px; /* c as a premultiplied a8r8g8b8 pixel */
+} Color;
+
+/* what a cell looks like when drawn, every byte of it set */
+typedef struct {
+	Rune u;
+	uint32_t mode, us;
+	pixman_color_t fg, bg, uc;
+} TileKey;
+
+/* a cell drawn with its background and decorations, to be copied */
+typedef struct Tile Tile;
+struct Tile {
+	TileKey k;
+	unsigned int hash;
+	pixman_image_t *pix; /* NULL if the glyph does not fit in the cell */
+	size_t size;
+	Tile *next;          /* in its hash bucket */
+	Tile *newer, *older; /* in the order of use */
+};
+
+/* the runes of a run shaped in a font, as fcft gave them */
+typedef struct Run Run;
+struct Run {
+	const struct fcft_font *font;
+	int len;
+	unsigned int hash;
+	struct fcft_text_run *run;
+	Run *next;          /* in its hash bucket */
+	Run *newer, *older; /* in the order of use */
+	Rune u[];
+};
+
+/* the fonts of a name, size and scale, with all that was drawn from them */
+typedef struct FontSet FontSet;
+struct FontSet {
+	const char *name;
+	double size;
+	uint32_t scale;
+	struct fcft_font *font[4]; /* loaded when first needed */
+	/* glyphs of the fonts as fcft gave them, filled when first drawn */
+	const struct fcft_glyph *latin1[4][256];
+	struct {
+		Rune u;
+		const struct fcft_glyph *glyph;
+	} glyphmap[4][GLYPHMAP]; /* of other runes, one per slot */
+	struct {
+		pixman_image_t *pix; /* a8 mask of one cell, repeated */
+		int y;               /* its top in the cell */
+	} ul[4][UNDERLINE_DASHED + 1]; /* of each font and underline style */
+	pixman_image_t *boxes; /* a8 atlas of the box glyphs, a cell each */
+	pixman_image_t *boxpix[BOXGLYPHS]; /* their cells in it once drawn */
+	signed char boxmade[BOXGLYPHS];    /* 1 once drawn, -1 if left to fcft */
+	struct fcft_glyph box[4][BOXGLYPHS]; /* as glyphs of each font */
+	FontSet *next;
 };
 
 /* Drawing Context */
 typedef struct {
-	pixman_color_t *col;
+	Color *col; /* palette, its fills made when loaded */
 	size_t collen;
-	struct fcft_font *font[4];
+	struct {
+		pixman_color_t c;
+		pixman_image_t *fill;
+		unsigned long used;
+	} fills[FILLCACHE]; /* fills of other colors, least recently used go */
+	unsigned long tick;
+#ifndef LIGATURES
+#ifndef BLIT
+	pixman_glyph_cache_t *glyphs; /* glyphs of the fonts, by font and rune */
+#endif
+	struct {
+		Tile *hash[TILEHASH];
+		Tile *newest, *oldest;
+		size_t size; /* bytes used by all of them */
+		unsigned long hits, misses;
+	} tiles;
+#else
+	struct {
+		Run *hash[RUNHASH];
+		Run *newest, *oldest;
+		int n;
+	} runs;
+#endif
+	FontSet *fs; /* fonts in use, then the others kept by last use */
 	struct fcft_font_options *font_options;
-	int fontsize;
 } DC;
 
 /* function definitions for wayland {{{ */
@@ -223,16 +315,51 @@ static inline ushort sixd_to_16bit(int);
 static void xdrawglyph(Glyph, int, int);
 #else
 static void xdrawglyph(Glyph, int, int, const struct fcft_glyph *);
-static void xdrawglyphbg(Glyph, int, int);
 #endif
+static void xdrawglyphbg(Glyph, int, int);
+static void xdrawbg(Line, int, int, int);
+static void xdrawborders(int, int, int);
 static void xclear(int, int, int, int);
-static void xdrawunderline(Glyph, int, int, struct fcft_font *,
-			   pixman_color_t *);
+static void bufrelease(void *);
+static void xdamage(int, int, int, int);
+static struct fcft_font *xfont(int);
+static void xloadunderlines(int);
+static void xdrawunderline(pixman_image_t *, Glyph, int, int, int, Color *);
+static void xdrawdecoration(pixman_image_t *, Glyph, int, int, int,
+			    struct fcft_font *, Color *);
+static void xdrawdecorations(const Glyph *, int, int, int, const char *);
+#ifndef LIGATURES
+#ifndef BLIT
+static const void *xglyph(int, Rune);
+static void xdrawglyphs(const pixman_glyph_t *, int, Color *);
+#endif
+static int xdrawtile(Glyph, int, int);
+static void xtileunlink(Tile *);
+static void xtilefree(Tile *);
+static void xtilesclear(void);
+#else
+static const struct fcft_text_run *xshape(int, const Rune *, int);
+static void xrununlink(Run *);
+static void xrunfree(Run *);
+static void xrunsclear(void);
+static void xdrawcursorline(Line, int, int, int);
+#endif
+static Color xglyphfg(Glyph);
+static Color xglyphbg(Glyph);
+static const struct fcft_glyph *xrasterize(int, Rune);
+static const struct fcft_glyph *xboxglyph(int, Rune);
+static Color xcolor(uint32_t);
+static uint32_t xpixel(const pixman_color_t *);
+#ifdef BLIT
+static void xblitglyph(const struct fcft_glyph *, int, int, Color *);
+#endif
+static pixman_image_t *xfill(Color *);
 static void cresize(int, int);
 static void xresize(int, int);
 static int xloadcolor(int, const char *, pixman_color_t *);
 static void xloadfonts(const char *, double);
 static void xunloadfonts(void);
+static void xfontsetfree(FontSet *);
 static void xseturgency(int);
 static int evcol(void);
 static int evrow(void);
@@ -342,7 +469,6 @@ void zoom(const Arg *arg)
 
 void zoomabs(const Arg *arg)
 {
-	xunloadfonts();
 	xloadfonts(usedfont, arg->f);
 	cresize(0, 0);
 	redraw();
@@ -566,7 +692,7 @@ int xloadcolor(int i, const char *name, pixman_color_t *clr)
 			return 1;
 		}
 		/* TODO: name = colorname[i]; */
-		*clr = dc.col[i];
+		*clr = dc.col[i].c;
 		return 1;
 	}
 
@@ -593,11 +719,13 @@ void xloadcols(void)
 
 	if (!loaded) {
 		dc.collen = MAX(LEN(colorname), 256);
-		dc.col    = xmalloc(dc.collen * sizeof(pixman_color_t));
+		dc.col    = xmalloc(dc.collen * sizeof(*dc.col));
+		for (i = 0; i < dc.collen; i++)
+			dc.col[i].fill = NULL;
 	}
 
 	for (i = 0; i < dc.collen; i++) {
-		if (!xloadcolor(i, colorname[i], &dc.col[i])) {
+		if (!xloadcolor(i, colorname[i], &dc.col[i].c)) {
 			if (colorname[i])
 				die("could not allocate color '%s'",
 				    colorname[i]);
@@ -606,10 +734,16 @@ void xloadcols(void)
 		}
 	}
 
-	dc.col[defaultbg].alpha *= alpha;
-	dc.col[defaultbg].red *= alpha;
-	dc.col[defaultbg].green *= alpha;
-	dc.col[defaultbg].blue *= alpha;
+	dc.col[defaultbg].c.alpha *= alpha;
+	dc.col[defaultbg].c.red *= alpha;
+	dc.col[defaultbg].c.green *= alpha;
+	dc.col[defaultbg].c.blue *= alpha;
+
+	for (i = 0; i < dc.collen; i++) {
+		if (dc.col[i].fill) pixman_image_unref(dc.col[i].fill);
+		dc.col[i].fill = pixman_image_create_solid_fill(&dc.col[i].c);
+		dc.col[i].px   = xpixel(&dc.col[i].c);
+	}
 
 	loaded = 1;
 }
@@ -618,9 +752,9 @@ int xgetcolor(int x, unsigned char *r, unsigned char *g, unsigned char *b)
 {
 	if (!BETWEEN(x, 0, (int)dc.collen - 1)) return 1;
 
-	*r = dc.col[x].red >> 8;
-	*g = dc.col[x].green >> 8;
-	*b = dc.col[x].blue >> 8;
+	*r = dc.col[x].c.red >> 8;
+	*g = dc.col[x].c.green >> 8;
+	*b = dc.col[x].c.blue >> 8;
 
 	return 0;
 }
@@ -633,19 +767,61 @@ int xsetcolorname(int x, const char *name)
 
 	if (!xloadcolor(x, name, &color)) return 1;
 
-	dc.col[x] = color;
+	dc.col[x].c = color;
 
 	/* set alpha value of bg color */
 	if ((unsigned int)x == defaultbg) {
-		dc.col[defaultbg].alpha *= alpha;
-		dc.col[defaultbg].red *= alpha;
-		dc.col[defaultbg].green *= alpha;
-		dc.col[defaultbg].blue *= alpha;
+		dc.col[defaultbg].c.alpha *= alpha;
+		dc.col[defaultbg].c.red *= alpha;
+		dc.col[defaultbg].c.green *= alpha;
+		dc.col[defaultbg].c.blue *= alpha;
 	}
 
+	pixman_image_unref(dc.col[x].fill);
+	dc.col[x].fill = pixman_image_create_solid_fill(&dc.col[x].c);
+	dc.col[x].px   = xpixel(&dc.col[x].c);
+
 	return 0;
 }
 
+/* the color of a glyph, an index in the palette or a true color */
+Color xcolor(uint32_t c)
+{
+	if (IS_TRUECOL(c))
+		return (Color){{TRUERED(c), TRUEGREEN(c), TRUEBLUE(c), 0xFFFF},
+			       NULL, 0xff000000 | (c & 0xffffff)};
+	return dc.col[c];
+}
+
+uint32_t xpixel(const pixman_color_t *c)
+{
+	return (uint32_t)(c->alpha >> 8) << 24 | (c->red >> 8) << 16 |
+	       (c->green & 0xff00) | c->blue >> 8;
+}
+
+/* a solid fill of the color, not to be kept by the caller */
+pixman_image_t *xfill(Color *c)
+{
+	int i, lru = 0;
+
+	if (c->fill) return c->fill;
+
+	for (i = 0; i < FILLCACHE; i++) {
+		if (dc.fills[i].fill &&
+		    !memcmp(&dc.fills[i].c, &c->c, sizeof(c->c)))
+			break;
+		if (dc.fills[i].used < dc.fills[lru].used) lru = i;
+	}
+	if (i == FILLCACHE) {
+		i = lru;
+		if (dc.fills[i].fill) pixman_image_unref(dc.fills[i].fill);
+		dc.fills[i].c    = c->c;
+		dc.fills[i].fill = pixman_image_create_solid_fill(&c->c);
+	}
+	dc.fills[i].used = ++dc.tick;
+	return c->fill = dc.fills[i].fill;
+}
+
 /*
  * Absolute coordinates
  */
@@ -653,133 +829,275 @@ void xclear(int x1, int y1, int x2, int y2)
 {
 	pixman_image_fill_boxes(
 	    PIXMAN_OP_SRC, swt.pix,
-	    &dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg], 1,
+	    &dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg].c, 1,
 	    &(pixman_box32_t){x1, y1, x2, y2});
+	xdamage(x1, y1, x2 - x1, y2 - y1);
+}
+
+void xdamage(int x, int y, int w, int h)
+{
+	if (w > 0 && h > 0)
+		pixman_region32_union_rect(&swt.damage, &swt.damage, x, y, w,
+					   h);
 }
 
+/*
+ * Makes the fonts of font at fontsize and the current scale the ones in use.
+ * Those used before are kept with all that was drawn from them, up to
+ * fontsets of them, so that zooming back or returning to an output of the
+ * same scale needs no loading nor rasterizing.
+ */
 void xloadfonts(const char *font, double fontsize)
 {
-	/* NOTE: this expects the length of the font name to be less than 256 */
-	char f[256];
-	char dpi[12];
-	unsigned i;
-	char attrs[64];
+	FontSet **p, *fs;
+	int n;
 	static int loaded;
 
 	if (!loaded) {
 		if (!fcft_init(FCFT_LOG_COLORIZE_AUTO, false,
 			       FCFT_LOG_CLASS_ERROR))
 			die("fcft_init:");
+		/* TODO: use fontconfig for reading font from config */
+		/* TODO: proper use of fcft font options */
+		if (!(dc.font_options = fcft_font_options_create()))
+			die("fcft_font_options_create:");
+		dc.font_options->scaling_filter = FCFT_SCALING_FILTER_LANCZOS3;
+		dc.font_options->emoji_presentation =
+		    FCFT_EMOJI_PRESENTATION_DEFAULT;
 		loaded = 1;
 	}
 
-	/* TODO: use fontconfig for reading font from config */
-	/* TODO: proper use of fcft font options */
-	if (!(dc.font_options = fcft_font_options_create()))
-		die("fcft_font_options_create:");
-	dc.font_options->scaling_filter     = FCFT_SCALING_FILTER_LANCZOS3;
-	dc.font_options->emoji_presentation = FCFT_EMOJI_PRESENTATION_DEFAULT;
-	snprintf(dpi, sizeof(dpi), "dpi=%d", wl.scale * 96);
-
-	for (i = 0; i < 4; i++) {
-		sprintf(f, "%s:size=%f", font, fontsize);
-		sprintf(attrs, "%s%s", dpi,
-			(const char *[]){"", ":weight=bold", ":slant=italic",
-					 ":weight=bold:slant=italic"}[i]);
-		dc.font[i] = fcft_from_name2(1, (const char *[]){f}, attrs,
-					     dc.font_options);
+	usedfontsize = fontsize;
+	for (p = &dc.fs; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->name, font) && (*p)->size == fontsize &&
+		    (*p)->scale == wl.scale)
+			break;
 	}
+	if (*p == dc.fs && dc.fs) return;
 
-	usedfontsize = fontsize;
+	if ((fs = *p)) {
+		*p = fs->next;
+	} else {
+		fs        = xmalloc(sizeof(*fs));
+		*fs       = (FontSet){0};
+		fs->name  = font;
+		fs->size  = fontsize;
+		fs->scale = wl.scale;
+	}
+	fs->next = dc.fs;
+	dc.fs    = fs;
 
+	/* the others are only loaded when some text needs them */
+	xfont(0);
 	/* FIXME: only works for monospace fonts */
-	win.cw = dc.font[0]->max_advance.x;
-	win.ch = dc.font[0]->height;
+	win.cw = fs->font[0]->max_advance.x;
+	win.ch = fs->font[0]->height;
+	if (!fs->boxes &&
+	    !(fs->boxes = pixman_image_create_bits(
+		  PIXMAN_a8, BOXGLYPHS * ((win.cw + 3) & ~3), win.ch, NULL, 0)))
+		die("pixman_image_create_bits failed");
+
+	for (n = 1, p = &fs->next; *p; n++) {
+		if (n < MAX(fontsets, 1)) {
+			p = &(*p)->next;
+			continue;
+		}
+		fs = *p;
+		*p = fs->next;
+		xfontsetfree(fs);
+	}
+#ifndef LIGATURES
+	/* they are drawn for the size of the cells */
+	xtilesclear();
+#ifndef BLIT
+	if (!dc.glyphs && !(dc.glyphs = pixman_glyph_cache_create()))
+		die("pixman_glyph_cache_create:");
+#endif
+#endif
 }
 
-void xunloadfonts(void)
+/*
+ * dc.fs->font[i], loaded the first time it is needed. Most sessions never
+ * show bold or italic text, and the first frame only has to wait for the
+ * regular font, which sets the size of the cells.
+ */
+struct fcft_font *xfont(int i)
 {
-	unsigned i;
-	for (i = 0; i < LEN(dc.font); i++)
-		if (dc.font[i]) fcft_destroy(dc.font[i]);
-	fcft_font_options_destroy(dc.font_options);
+	/* NOTE: this expects the length of the font name to be less than 256 */
+	char f[256];
+	char attrs[64];
+
+	if (dc.fs->font[i]) return dc.fs->font[i];
+
+	snprintf(f, sizeof(f), "%s:size=%f", dc.fs->name, dc.fs->size);
+	snprintf(attrs, sizeof(attrs), "dpi=%d%s", dc.fs->scale * 96,
+		 (const char *[]){"", ":weight=bold", ":slant=italic",
+				  ":weight=bold:slant=italic"}[i]);
+	if (!(dc.fs->font[i] = fcft_from_name2(1, (const char *[]){f}, attrs,
+					       dc.font_options))) {
+		if (i == 0) die("could not load font '%s'", f);
+		warn("could not load font '%s' with '%s'", f, attrs);
+		dc.fs->font[i] = fcft_clone(dc.fs->font[0]);
+	}
+	if (i == 0) {
+		win.cw = dc.fs->font[0]->max_advance.x;
+		win.ch = dc.fs->font[0]->height;
+	}
+	xloadunderlines(i);
+	return dc.fs->font[i];
 }
 
-void xdrawunderline(Glyph g, int x, int y, struct fcft_font *f,
-		    pixman_color_t *fg)
+/* draws the underlines of each style of font i once, to be repeated */
+void xloadunderlines(int i)
 {
-	pixman_image_t *pix = swt.pix, *fill;
-	pixman_color_t *uc;
-	int th  = f->underline.thickness;
-	int off = win.ch - (f->underline.position + f->descent);
-	int top, bot, lx, rx, mx;
-	int dotn = MAX(1, win.cw / (th * 2)), dx, space, i;
-	pixman_rectangle16_t rects[dotn];
-	int dashw;
+	const pixman_color_t opaque = {0, 0, 0, 0xFFFF};
+	pixman_image_t *pix;
+	struct fcft_font *f = dc.fs->font[i];
+	int us, th, off, top, bot, mx, h, dotn, dx, space, k, dashw;
+
+	th   = MAX(f->underline.thickness, 1);
+	off  = win.ch - (f->underline.position + f->descent);
+	dotn = MAX(1, win.cw / (th * 2));
+	for (us = UNDERLINE_SINGLE; us <= UNDERLINE_DASHED; us++) {
+		top = us == UNDERLINE_CURLY ? off - th : off;
+		h   = us == UNDERLINE_CURLY    ? th * 7
+		      : us == UNDERLINE_DOUBLE ? th * 3
+					       : th;
+		if (!(pix = pixman_image_create_bits(
+			  PIXMAN_a8, win.cw, h, NULL, 0)))
+			die("pixman_image_create_bits failed");
+		pixman_image_set_repeat(pix, PIXMAN_REPEAT_NORMAL);
+		dc.fs->ul[i][us].pix = pix;
+		dc.fs->ul[i][us].y   = top;
+
+		switch (us) {
+		case UNDERLINE_SINGLE:
+			pixman_image_fill_rectangles(
+			    PIXMAN_OP_SRC, pix, &opaque, 1,
+			    &(pixman_rectangle16_t){0, 0, win.cw, th});
+			break;
+		case UNDERLINE_DOUBLE:
+			pixman_image_fill_rectangles(
+			    PIXMAN_OP_SRC, pix, &opaque, 2,
+			    (pixman_rectangle16_t[]){
+				{0, 0,      win.cw, th},
+				{0, th * 2, win.cw, th},
+                        });
+			break;
+		case UNDERLINE_CURLY:
+			top = th;
+			bot = top + th * 5;
+			mx  = win.cw / 2;
+#define I(n) pixman_int_to_fixed(n)
+			pixman_add_trapezoids(
+			    pix, 0, 0, 2,
+			    (pixman_trapezoid_t[]){
+				{I(top),
+				 I(bot),
+				 {{I(0), I(bot - th)}, {I(mx), I(top - th)}},
+				 {{I(0), I(bot + th)}, {I(mx), I(top + th)}}},
+				{I(top),
+				 I(bot),
+				 {{I(mx), I(top + th)}, {I(win.cw), I(bot + th)}},
+				 {{I(mx), I(top - th)}, {I(win.cw), I(bot - th)}}},
+                        });
+#undef I
+			break;
+		case UNDERLINE_DOTTED:
+			dx    = 0;
+			space = win.cw - (dotn * 2) * th;
+			for (k = 0; k < dotn; k++) {
+				pixman_image_fill_rectangles(
+				    PIXMAN_OP_SRC, pix, &opaque, 1,
+				    &(pixman_rectangle16_t){dx, 0, th,
+							    th});
+				dx += th * 2 + (k < space);
+			}
+			break;
+		case UNDERLINE_DASHED:
+			dashw = win.cw / 3 + (win.cw % 3 > 0);
+			pixman_image_fill_rectangles(
+			    PIXMAN_OP_SRC, pix, &opaque, 2,
+			    (pixman_rectangle16_t[]){
+				{0,         0, dashw, th},
+				{dashw * 2, 0, dashw, th},
+                        });
+			break;
+		}
+	}
+}
 
-	if (~g.mode & ATTR_UNDERLINE) return;
+/* destroys the fonts of fs, which is not in use, and what they drew */
+void xfontsetfree(FontSet *fs)
+{
+	unsigned i, us;
+#ifdef LIGATURES
+	Run *r, *older;
+
+	/* their glyphs were made by the fonts */
+	for (r = dc.runs.newest; r; r = older) {
+		older = r->older;
+		for (i = 0; i < LEN(fs->font); i++) {
+			if (fs->font[i] && r->font == fs->font[i]) {
+				xrunfree(r);
+				break;
+			}
+		}
+	}
+#elif !defined(BLIT)
+	/* the fonts are its keys, and their addresses may be reused */
+	if (dc.glyphs) pixman_glyph_cache_destroy(dc.glyphs);
+	dc.glyphs = NULL;
+#endif
+	for (i = 0; i < LEN(fs->font); i++) {
+		if (fs->font[i]) fcft_destroy(fs->font[i]);
+		for (us = 0; us < LEN(fs->ul[i]); us++) {
+			if (fs->ul[i][us].pix) pixman_image_unref(fs->ul[i][us].pix);
+		}
+	}
+	for (i = 0; i < BOXGLYPHS; i++) {
+		if (fs->boxpix[i]) pixman_image_unref(fs->boxpix[i]);
+	}
+	if (fs->boxes) pixman_image_unref(fs->boxes);
+	free(fs);
+}
 
-	uc = g.mode & ATTR_COLORED_UNDERLINE ? GETPIXMANCOLOR(g.uc) : fg;
+void xunloadfonts(void)
+{
+	FontSet *fs;
 
-	switch (g.us) {
-	case UNDERLINE_NONE:   break;
-	case UNDERLINE_SINGLE: {
-		pixman_image_fill_rectangles(PIXMAN_OP_SRC, pix, uc, 1,
-					     (pixman_rectangle16_t[]){
-						 {x, y + off, win.cw, th},
-                });
-	} break;
-	case UNDERLINE_DOUBLE: {
-		pixman_image_fill_rectangles(
-		    PIXMAN_OP_SRC, pix, uc, 2,
-		    (pixman_rectangle16_t[]){
-			{x, y + off,          win.cw, th},
-			{x, y + off + th * 2, win.cw, th},
-                });
-	} break;
-	case UNDERLINE_CURLY: {
-		top = y + off;
-		bot = top + th * 5;
-		lx  = x;
-		rx  = x + win.cw;
-		mx  = lx + win.cw / 2;
-#define I(n) pixman_int_to_fixed(n)
-		fill = pixman_image_create_solid_fill(uc);
-		pixman_composite_trapezoids(
-		    PIXMAN_OP_OVER, fill, pix, PIXMAN_a8, 0, 0, 0, 0, 2,
-		    (pixman_trapezoid_t[]){
-			{I(top),
-			 I(bot),
-			 {{I(lx), I(bot - th)}, {I(mx), I(top - th)}},
-			 {{I(lx), I(bot + th)}, {I(mx), I(top + th)}}},
-			{I(top),
-			 I(bot),
-			 {{I(mx), I(top + th)}, {I(rx), I(bot + th)}},
-			 {{I(mx), I(top - th)}, {I(rx), I(bot - th)}}},
-                });
-		pixman_image_unref(fill);
-	} break;
-	case UNDERLINE_DOTTED: {
-		dx    = x;
-		space = win.cw - (dotn * 2) * th;
-		for (i = 0; i < dotn; i++) {
-			rects[i] = (pixman_rectangle16_t){dx, y + off, th, th};
-			dx += th * 2 + (i < space);
-		}
-		pixman_image_fill_rectangles(PIXMAN_OP_SRC, pix, uc, dotn,
-					     rects);
-	} break;
-	case UNDERLINE_DASHED: {
-		dashw = win.cw / 3 + (win.cw % 3 > 0);
-		pixman_image_fill_rectangles(
-		    PIXMAN_OP_SRC, pix, uc, 2,
-		    (pixman_rectangle16_t[]){
-			{x,             y + off, dashw, th},
-			{x + dashw * 2, y + off, dashw, th},
-                });
-	} break;
-	default: warn("unsupported underline style");
+#ifdef LIGATURES
+	xrunsclear();
+#else
+	xtilesclear();
+#endif
+	while ((fs = dc.fs)) {
+		dc.fs = fs->next;
+		xfontsetfree(fs);
 	}
+	fcft_font_options_destroy(dc.font_options);
+	dc.font_options = NULL;
+}
+
+/* draws the underline of g under n cells from x, y, all in one go */
+void xdrawunderline(pixman_image_t *pix, Glyph g, int x, int y, int n,
+		    Color *fg)
+{
+	Color uc;
+	const Style *st = tstyle(g.style);
+
+	if (~g.mode & ATTR_UNDERLINE || st->us == UNDERLINE_NONE) return;
+	if (st->us > UNDERLINE_DASHED) {
+		warn("unsupported underline style");
+		return;
+	}
+
+	uc = g.mode & ATTR_COLORED_UNDERLINE ? xcolor(st->uc) : *fg;
+	pixman_image_composite32(
+	    PIXMAN_OP_OVER, xfill(&uc), dc.fs->ul[FONTIDX(g.mode)][st->us].pix,
+	    pix, 0, 0, 0, 0, x, y + dc.fs->ul[FONTIDX(g.mode)][st->us].y,
+	    n * win.cw,
+	    pixman_image_get_height(dc.fs->ul[FONTIDX(g.mode)][st->us].pix));
 }
 
 #ifndef LIGATURES
@@ -788,20 +1106,83 @@ void xdrawglyph(Glyph g, int x, int y)
 void xdrawglyph(Glyph g, int x, int y, const struct fcft_glyph *lig)
 #endif
 {
-	pixman_image_t *pix = swt.pix, *fill;
-	pixman_color_t *fg, *bg, *tmp;
+	Color fg = xglyphfg(g);
 	const struct fcft_glyph *glyph;
-	struct fcft_font *f =
-	    dc.font[(!!(g.mode & ATTR_BOLD)) + (!!(g.mode & ATTR_ITALIC)) * 2];
+	struct fcft_font *f = xfont(FONTIDX(g.mode));
 	int winx = borderpx + x * win.cw, winy = borderpx + y * win.ch;
 
-	fg = GETPIXMANCOLOR(g.fg);
-	bg = GETPIXMANCOLOR(g.bg);
+	/* the background is filled by xdrawbg() or xdrawglyphbg() */
+#ifndef LIGATURES
+	glyph = xrasterize(FONTIDX(g.mode), g.u);
+#else
+	/* the font's box glyphs would not meet the cells around */
+	if (!(glyph = xboxglyph(FONTIDX(g.mode), g.u)))
+		glyph = lig ? lig : xrasterize(FONTIDX(g.mode), g.u);
+#endif
+
+	if (!glyph) return;
+
+#ifdef BLIT
+	xblitglyph(glyph, winx, winy + win.ch - f->descent, &fg);
+#else
+	pixman_image_composite32(
+	    PIXMAN_OP_OVER, xfill(&fg), glyph->pix, swt.pix, 0, 0, 0, 0,
+	    winx + glyph->x, winy + win.ch - f->descent - glyph->y,
+	    glyph->width, glyph->height);
+	/* wide and italic glyphs can reach out of their cell */
+	xdamage(winx + glyph->x, winy + win.ch - f->descent - glyph->y,
+		glyph->width, glyph->height);
+#endif
+}
+
+#ifdef BLIT
+/* blends glyph in fg at its origin, straight into the buffer */
+void xblitglyph(const struct fcft_glyph *glyph, int x, int y, Color *fg)
+{
+	pixman_image_t *mask = glyph->pix;
+	uint32_t *data       = pixman_image_get_data(swt.pix);
+	int stride           = pixman_image_get_stride(swt.pix) / 4;
+	int mstride, mx = 0, my = 0, w = glyph->width, h = glyph->height;
+
+	x += glyph->x;
+	y -= glyph->y;
+	/* wide and italic glyphs can reach out of their cell */
+	xdamage(x, y, w, h);
+
+	/* color glyphs are left to pixman */
+	if (pixman_image_get_format(mask) != PIXMAN_a8) {
+		pixman_image_composite32(PIXMAN_OP_OVER, xfill(fg), mask,
+					 swt.pix, 0, 0, 0, 0, x, y, w, h);
+		return;
+	}
+
+	if (x < 0) mx = -x, w += x, x = 0;
+	if (y < 0) my = -y, h += y, y = 0;
+	w = MIN(w, pixman_image_get_width(swt.pix) - x);
+	h = MIN(h, pixman_image_get_height(swt.pix) - y);
+	if (w <= 0 || h <= 0) return;
 
+	mstride = pixman_image_get_stride(mask);
+	blitmask(data + y * stride + x, stride,
+		 (uint8_t *)pixman_image_get_data(mask) + my * mstride + mx,
+		 mstride, w, h, fg->px);
+}
+#endif
+
+/* the color the text of a glyph is drawn in */
+Color xglyphfg(Glyph g)
+{
+	const Style *st = tstyle(g.style);
+	Color fg = xcolor(st->fg), bg = xcolor(st->bg), tmp;
+
+	/* relative to the background, so its fill is looked up again */
 	if ((g.mode & ATTR_BOLD_FAINT) == ATTR_FAINT) {
-		fg->red += (1 - 2 * (fg->red > bg->red)) * fg->red / 2;
-		fg->green += (1 - 2 * (fg->green > bg->green)) * fg->green / 2;
-		fg->blue += (1 - 2 * (fg->blue > bg->blue)) * fg->blue / 2;
+		fg.c.red += (1 - 2 * (fg.c.red > bg.c.red)) * fg.c.red / 2;
+		fg.c.green +=
+		    (1 - 2 * (fg.c.green > bg.c.green)) * fg.c.green / 2;
+		fg.c.blue += (1 - 2 * (fg.c.blue > bg.c.blue)) * fg.c.blue / 2;
+		fg.fill = NULL;
+		fg.px   = xpixel(&fg.c);
 	}
 
 	if (g.mode & ATTR_REVERSE) {
@@ -814,75 +1195,430 @@ void xdrawglyph(Glyph g, int x, int y, const struct fcft_glyph *lig)
 
 	if (g.mode & ATTR_INVISIBLE) fg = bg;
 
-	/* Intelligent cleaning up of the borders. */
-	/* NOTE: in st it is bugged, here it is fixed */
-	if (x == 0) {
-		xclear(0, (y == 0) ? 0 : winy, borderpx,
-		       ((winy + win.ch >= borderpx + win.th)
-			    ? win.h
-			    : (winy + win.ch)));
-	}
-	if (winx + win.cw >= borderpx + win.tw) {
-		xclear(winx + win.cw, (y == 0) ? 0 : winy, win.w,
-		       ((winy + win.ch >= borderpx + win.th)
-			    ? win.h
-			    : (winy + win.ch)));
-	}
-	if (y == 0) xclear(winx, 0, winx + win.cw, borderpx);
-	if (winy + win.ch >= borderpx + win.th)
-		xclear(winx, winy + win.ch, winx + win.cw, win.h);
+	return fg;
+}
 
-#ifndef LIGATURES
-	pixman_image_fill_rectangles(
-	    PIXMAN_OP_SRC, pix, bg, 1,
-	    &(pixman_rectangle16_t){
-		.x = winx, .y = winy, .width = win.cw, .height = win.ch});
+/* the color the cell of a glyph is filled with, a faint one when reversed */
+Color xglyphbg(Glyph g)
+{
+	g.mode ^= ATTR_REVERSE;
+	g.mode &= ~(ATTR_BLINK | ATTR_INVISIBLE);
+	return xglyphfg(g);
+}
 
-	glyph = fcft_rasterize_char_utf32(f, g.u, FCFT_SUBPIXEL_NONE);
-#else
-	if (lig)
-		glyph = lig;
-	else
-		glyph = fcft_rasterize_char_utf32(f, g.u, FCFT_SUBPIXEL_NONE);
-#endif
+/* the glyph of u in font i, only asked to fcft the first time */
+const struct fcft_glyph *xrasterize(int i, Rune u)
+{
+	const struct fcft_glyph **gp;
 
-	if (!glyph) return;
+	if (u < LEN(dc.fs->latin1[i])) {
+		gp = &dc.fs->latin1[i][u];
+	} else {
+		gp = &dc.fs->glyphmap[i][u % GLYPHMAP].glyph;
+		if (dc.fs->glyphmap[i][u % GLYPHMAP].u != u) {
+			dc.fs->glyphmap[i][u % GLYPHMAP].u = u;
+			*gp = NULL;
+		}
+	}
+	if (!*gp && !(*gp = xboxglyph(i, u)))
+		*gp = fcft_rasterize_char_utf32(xfont(i), u,
+						FCFT_SUBPIXEL_NONE);
+	return *gp;
+}
 
-	fill = pixman_image_create_solid_fill(fg);
-	pixman_image_composite32(
-	    PIXMAN_OP_OVER, fill, glyph->pix, pix, 0, 0, 0, 0, winx + glyph->x,
-	    winy + win.ch - f->descent - glyph->y, glyph->width, glyph->height);
-	pixman_image_unref(fill);
+/*
+ * The glyph of u drawn by boxdraw() to fill the cell, NULL if it is left to
+ * fcft. It is drawn in the atlas the first time, for all fonts.
+ */
+const struct fcft_glyph *xboxglyph(int i, Rune u)
+{
+	pixman_image_t *pix;
+	int k = boxidx(u);
+	int lt = boxthickness > 0 ? boxthickness
+				  : MAX(dc.fs->font[0]->underline.thickness, 1);
+
+	if (!boxglyphs || k < 0 || dc.fs->boxmade[k] < 0) return NULL;
+
+	if (!dc.fs->boxmade[k]) {
+		pix = pixman_image_create_bits(
+		    PIXMAN_a8, win.cw, win.ch,
+		    (uint32_t *)((char *)pixman_image_get_data(dc.fs->boxes) +
+				 k * ((win.cw + 3) & ~3)),
+		    pixman_image_get_stride(dc.fs->boxes));
+		if (!pix || !boxdraw(pix, u, win.cw, win.ch, lt)) {
+			if (pix) pixman_image_unref(pix);
+			dc.fs->boxmade[k] = -1;
+			return NULL;
+		}
+		dc.fs->boxpix[k]  = pix;
+		dc.fs->boxmade[k] = 1;
+	}
+	if (!dc.fs->box[i][k].pix) {
+		dc.fs->box[i][k] = (struct fcft_glyph){
+		    .cp      = u,
+		    .cols    = 1,
+		    .pix     = dc.fs->boxpix[k],
+		    .y       = win.ch - xfont(i)->descent,
+		    .width   = win.cw,
+		    .height  = win.ch,
+		    .advance = {win.cw, 0},
+		};
+	}
+	return &dc.fs->box[i][k];
+}
 
-	xdrawunderline(g, winx, winy, f, fg);
+/* draws the underline and strikethrough of a glyph at winx, winy */
+void xdrawdecoration(pixman_image_t *pix, Glyph g, int winx, int winy, int n,
+		     struct fcft_font *f, Color *fg)
+{
+	xdrawunderline(pix, g, winx, winy, n, fg);
 
 	if (g.mode & ATTR_STRUCK) {
 		pixman_image_fill_rectangles(
-		    PIXMAN_OP_SRC, pix, fg, 1,
+		    PIXMAN_OP_SRC, pix, &fg->c, 1,
 		    &(pixman_rectangle16_t){
 			.x = winx,
 			.y = winy + win.ch - f->strikeout.position - f->descent,
-			.width  = win.cw,
+			.width  = n * win.cw,
 			.height = f->underline.thickness,
 		    });
 	}
 }
 
-#ifdef LIGATURES
+/*
+ * Draws the decorations of the n cells of g from x, y, over their glyphs,
+ * each run of cells that look the same in one go. Cells set in skip are
+ * left alone.
+ */
+void xdrawdecorations(const Glyph *g, int n, int x, int y, const char *skip)
+{
+	Color fg;
+	int i, j;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && (!skip || !skip[j]) &&
+				g[j].mode == g[i].mode && g[j].style == g[i].style;
+		     j++)
+			;
+		if ((skip && skip[i]) ||
+		    !(g[i].mode & (ATTR_UNDERLINE | ATTR_STRUCK)))
+			continue;
+		fg = xglyphfg(g[i]);
+		xdrawdecoration(swt.pix, g[i], borderpx + (x + i) * win.cw,
+				borderpx + y * win.ch, j - i,
+				xfont(FONTIDX(g[i].mode)), &fg);
+	}
+}
+
+#if !defined(LIGATURES) && !defined(BLIT)
+/* the glyph of u in font i in the glyph cache, which has to be frozen */
+const void *xglyph(int i, Rune u)
+{
+	const struct fcft_glyph *glyph;
+	const void *g;
+	struct fcft_font *f = xfont(i);
+
+	if ((g = pixman_glyph_cache_lookup(dc.glyphs, f, (void *)(uintptr_t)u)))
+		return g;
+	if (!(glyph = xrasterize(i, u))) return NULL;
+	return pixman_glyph_cache_insert(dc.glyphs, f, (void *)(uintptr_t)u,
+					 -glyph->x, glyph->y, glyph->pix);
+}
+#endif
+
+#ifndef LIGATURES
+/*
+ * Copies the cell of g at x, y from a tile, which is drawn the first time.
+ * Returns 0 if the glyph reaches out of the cell and has to be drawn.
+ */
+int xdrawtile(Glyph g, int x, int y)
+{
+	const Style *st = tstyle(g.style);
+	struct fcft_font *f = xfont(FONTIDX(g.mode));
+	const struct fcft_glyph *glyph;
+	TileKey k;
+	Tile *t;
+	Color fg, bg;
+	unsigned int h = 2166136261u, i;
+	int tw = (g.mode & ATTR_WIDE ? 2 : 1) * win.cw, gy;
+
+	if (tilecache == 0) return 0;
+
+	fg = xglyphfg(g);
+	bg = xglyphbg(g);
+	memset(&k, 0, sizeof(k));
+	k.u    = g.u;
+	k.mode = g.mode & (ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE |
+			   ATTR_COLORED_UNDERLINE | ATTR_STRUCK | ATTR_WIDE);
+	k.fg   = fg.c;
+	k.bg   = bg.c;
+	if (g.mode & ATTR_UNDERLINE) {
+		k.us = st->us;
+		k.uc = g.mode & ATTR_COLORED_UNDERLINE ? xcolor(st->uc).c
+						       : fg.c;
+	}
+	for (i = 0; i < sizeof(k); i++)
+		h = (h ^ ((unsigned char *)&k)[i]) * 16777619u;
+
+	for (t = dc.tiles.hash[h % TILEHASH]; t; t = t->next) {
+		if (t->hash == h && !memcmp(&t->k, &k, sizeof(k))) break;
+	}
+	if (t) {
+		dc.tiles.hits++;
+		xtileunlink(t);
+	} else {
+		dc.tiles.misses++;
+		t       = xmalloc(sizeof(*t));
+		t->k    = k;
+		t->hash = h;
+		t->pix  = NULL;
+		t->size = sizeof(*t);
+		glyph   = xrasterize(FONTIDX(g.mode), g.u);
+		gy      = glyph ? win.ch - f->descent - glyph->y : 0;
+		if (glyph && glyph->x >= 0 && glyph->x + glyph->width <= tw &&
+		    gy >= 0 && gy + glyph->height <= win.ch &&
+		    (t->pix = pixman_image_create_bits(PIXMAN_a8r8g8b8, tw,
+						       win.ch, NULL, 0))) {
+			pixman_image_fill_rectangles(
+			    PIXMAN_OP_SRC, t->pix, &bg.c, 1,
+			    &(pixman_rectangle16_t){0, 0, tw, win.ch});
+			pixman_image_composite32(
+			    PIXMAN_OP_OVER, xfill(&fg), glyph->pix, t->pix, 0,
+			    0, 0, 0, glyph->x, gy, glyph->width, glyph->height);
+			xdrawdecoration(t->pix, g, 0, 0, 1, f, &fg);
+			t->size += tw * win.ch * 4;
+		}
+		t->next = dc.tiles.hash[h % TILEHASH];
+		dc.tiles.hash[h % TILEHASH] = t;
+		dc.tiles.size += t->size;
+	}
+
+	/* it becomes the newest, the oldest go if over budget */
+	t->older = dc.tiles.newest;
+	t->newer = NULL;
+	if (dc.tiles.newest) dc.tiles.newest->newer = t;
+	dc.tiles.newest = t;
+	if (!dc.tiles.oldest) dc.tiles.oldest = t;
+	while (dc.tiles.size > tilecache && dc.tiles.oldest != t)
+		xtilefree(dc.tiles.oldest);
+
+	if (!t->pix) return 0;
+	pixman_image_composite32(PIXMAN_OP_SRC, t->pix, NULL, swt.pix, 0, 0, 0,
+				 0, borderpx + x * win.cw,
+				 borderpx + y * win.ch, tw, win.ch);
+	xdamage(borderpx + x * win.cw, borderpx + y * win.ch, tw, win.ch);
+	return 1;
+}
+
+/* takes t out of the order of use */
+void xtileunlink(Tile *t)
+{
+	if (t->newer) t->newer->older = t->older;
+	else dc.tiles.newest = t->older;
+	if (t->older) t->older->newer = t->newer;
+	else dc.tiles.oldest = t->newer;
+}
+
+void xtilefree(Tile *t)
+{
+	Tile **p = &dc.tiles.hash[t->hash % TILEHASH];
+
+	while (*p != t)
+		p = &(*p)->next;
+	*p = t->next;
+	xtileunlink(t);
+	dc.tiles.size -= t->size;
+	if (t->pix) pixman_image_unref(t->pix);
+	free(t);
+}
+
+void xtilesclear(void)
+{
+	while (dc.tiles.oldest)
+		xtilefree(dc.tiles.oldest);
+}
+
+#ifndef BLIT
+/* composites glyphs of the glyph cache in one color */
+void xdrawglyphs(const pixman_glyph_t *glyphs, int n, Color *fg)
+{
+	pixman_box32_t b;
+
+	if (n == 0) return;
+
+	pixman_glyph_get_extents(dc.glyphs, n, (pixman_glyph_t *)glyphs, &b);
+	pixman_composite_glyphs(PIXMAN_OP_OVER, xfill(fg), swt.pix, PIXMAN_a8,
+				b.x1, b.y1, b.x1, b.y1, b.x1, b.y1,
+				b.x2 - b.x1, b.y2 - b.y1, dc.glyphs, n, glyphs);
+	/* wide and italic glyphs can reach out of their cell */
+	xdamage(b.x1, b.y1, b.x2 - b.x1, b.y2 - b.y1);
+}
+#endif
+#else
+/* the len runes of u shaped in font i, only asked to fcft the first time */
+const struct fcft_text_run *xshape(int i, const Rune *u, int len)
+{
+	unsigned int h = 2166136261u ^ i, k;
+	Run *r;
+
+	for (k = 0; k < len * sizeof(*u); k++)
+		h = (h ^ ((unsigned char *)u)[k]) * 16777619u;
+
+	for (r = dc.runs.hash[h % RUNHASH]; r; r = r->next) {
+		if (r->hash == h && r->font == xfont(i) && r->len == len &&
+		    !memcmp(r->u, u, len * sizeof(*u)))
+			break;
+	}
+	if (r) {
+		xrununlink(r);
+	} else {
+		r = xmalloc(sizeof(*r) + len * sizeof(*u));
+		if (!(r->run = fcft_rasterize_text_run_utf32(
+			  xfont(i), len, u, FCFT_SUBPIXEL_NONE))) {
+			free(r);
+			return NULL;
+		}
+		r->font = xfont(i);
+		r->len  = len;
+		r->hash = h;
+		memcpy(r->u, u, len * sizeof(*u));
+		r->next = dc.runs.hash[h % RUNHASH];
+		dc.runs.hash[h % RUNHASH] = r;
+		dc.runs.n++;
+	}
+
+	/* it becomes the newest, the oldest go if over budget */
+	r->older = dc.runs.newest;
+	r->newer = NULL;
+	if (dc.runs.newest) dc.runs.newest->newer = r;
+	dc.runs.newest = r;
+	if (!dc.runs.oldest) dc.runs.oldest = r;
+	while (dc.runs.n > MAX(runcache, 1) && dc.runs.oldest != r)
+		xrunfree(dc.runs.oldest);
+
+	return r->run;
+}
+
+/* takes r out of the order of use */
+void xrununlink(Run *r)
+{
+	if (r->newer) r->newer->older = r->older;
+	else dc.runs.newest = r->older;
+	if (r->older) r->older->newer = r->newer;
+	else dc.runs.oldest = r->newer;
+}
+
+void xrunfree(Run *r)
+{
+	Run **p = &dc.runs.hash[r->hash % RUNHASH];
+
+	while (*p != r)
+		p = &(*p)->next;
+	*p = r->next;
+	xrununlink(r);
+	dc.runs.n--;
+	fcft_text_run_destroy(r->run);
+	free(r);
+}
+
+void xrunsclear(void)
+{
+	while (dc.runs.oldest)
+		xrunfree(dc.runs.oldest);
+}
+
+/* redraws the run of line y that cell x is shaped with */
+void xdrawcursorline(Line line, int x, int y, int len)
+{
+	int x1 = x, x2 = x + 1;
+
+	while (x1 > 0 && RUNMODE(line, x1 - 1) == RUNMODE(line, x))
+		x1--;
+	while (x2 < len && RUNMODE(line, x2) == RUNMODE(line, x))
+		x2++;
+	xdrawline(line, x1, y, x2);
+}
+#endif
+
 void xdrawglyphbg(Glyph g, int x, int y)
 {
 	pixman_image_t *pix = swt.pix;
-	pixman_color_t *bg;
+	Color bg = xglyphbg(g);
 	int winx = borderpx + x * win.cw, winy = borderpx + y * win.ch;
 
-	bg = GETPIXMANCOLOR((g.mode & ATTR_REVERSE) ? g.fg : g.bg);
+	xdamage(winx, winy, win.cw, win.ch);
 
 	pixman_image_fill_rectangles(
-	    PIXMAN_OP_SRC, pix, bg, 1,
+	    PIXMAN_OP_SRC, pix, &bg.c, 1,
 	    &(pixman_rectangle16_t){
 		.x = winx, .y = winy, .width = win.cw, .height = win.ch});
 }
+
+/*
+ * Fills the background of cells x1 up to x2 of row y with a rectangle for
+ * each run of the same color, and one call for all the runs of a color.
+ */
+void xdrawbg(Line line, int x1, int y, int x2)
+{
+	pixman_rectangle16_t r[x2 - x1], tr;
+	Color c[x2 - x1], tc, bg;
+	int i, j, k, n = 0, winy = borderpx + y * win.ch;
+#ifdef BLIT
+	uint32_t *data = pixman_image_get_data(swt.pix);
+	int stride     = pixman_image_get_stride(swt.pix) / 4;
+#endif
+
+	xdamage(borderpx + x1 * win.cw, winy, (x2 - x1) * win.cw, win.ch);
+
+	for (i = x1; i < x2; i++) {
+		/* a dummy cell is the right half of the wide glyph before it */
+		bg = xglyphbg(line[i - (i > 0 && line[i].mode & ATTR_WDUMMY)]);
+		if (n > 0 && c[n - 1].px == bg.px) {
+			r[n - 1].width += win.cw;
+			continue;
+		}
+		c[n]   = bg;
+		r[n++] = (pixman_rectangle16_t){borderpx + i * win.cw, winy,
+						win.cw, win.ch};
+	}
+
+	for (i = 0; i < n; i = j) {
+		/* gather the other runs of this color after it */
+		for (j = k = i + 1; k < n; k++) {
+			if (c[k].px != c[i].px) continue;
+			tr     = r[j];
+			r[j]   = r[k];
+			r[k]   = tr;
+			tc     = c[j];
+			c[j]   = c[k];
+			c[k]   = tc;
+			j++;
+		}
+#ifdef BLIT
+		for (k = i; k < j; k++) {
+			blitfill(data + r[k].y * stride + r[k].x, stride,
+				 r[k].width, r[k].height, c[i].px);
+		}
+#else
+		pixman_image_fill_rectangles(PIXMAN_OP_SRC, swt.pix, &c[i].c,
+					     j - i, &r[i]);
 #endif
+	}
+}
+
+/* cleans up the borders next to cells x1 up to x2 of row y */
+void xdrawborders(int x1, int y, int x2)
+{
+	int winy = borderpx + y * win.ch;
+	int last = winy + win.ch >= borderpx + win.th;
+	int top = (y == 0) ? 0 : winy, bot = last ? win.h : winy + win.ch;
+	int l = borderpx + x1 * win.cw, r = borderpx + x2 * win.cw;
+
+	if (x1 == 0) xclear(0, top, borderpx, bot);
+	if (r >= borderpx + win.tw) xclear(r, top, win.w, bot);
+	if (y == 0) xclear(l, 0, r, borderpx);
+	if (last) xclear(l, winy + win.ch, r, win.h);
+}
 
 #ifndef LIGATURES
 void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
@@ -893,33 +1629,35 @@ void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line,
 {
 	unsigned int thicc  = cursorthickness;
 	pixman_image_t *pix = swt.pix;
-	pixman_color_t *drawcol;
-	uint32_t tmp;
+	Color drawcol;
+	const Style *st = tstyle(g.style);
 	int x = borderpx + cx * win.cw, y = borderpx + cy * win.ch;
 
 	/* remove the old cursor */
 	if (selected(ox, oy)) og.mode ^= ATTR_REVERSE;
 #ifndef LIGATURES
+	xdrawborders(ox, oy, ox + 1);
+	xdrawglyphbg(og, ox, oy);
 	xdrawglyph(og, ox, oy);
+	xdrawdecorations(&og, 1, ox, oy, NULL);
 #else
-	xdrawline(line, 0, oy, len);
+	/* ligatures around it may change, the rest of the line cannot */
+	xdrawcursorline(line, ox, oy, len);
 #endif
 
 	if (IS_SET(MODE_HIDE)) return;
 
+	xdamage(x, y, win.cw, win.ch);
+
 	/*
 	 * Select the right color for the right mode.
 	 */
 	g.mode &=
 	    ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_STRUCK | ATTR_WIDE;
 
-	if (!selected(cx, cy)) {
-		tmp  = g.fg;
-		g.fg = g.bg;
-		g.bg = tmp;
-	}
+	if (!selected(cx, cy)) g.mode |= ATTR_REVERSE;
 
-	drawcol = GETPIXMANCOLOR(g.bg);
+	drawcol = xcolor((g.mode & ATTR_REVERSE) ? st->fg : st->bg);
 
 	/* draw the new one */
 	if (IS_SET(MODE_FOCUSED)) {
@@ -927,29 +1665,30 @@ void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line,
 		case 0: /* Blinking Block */
 		case 1: /* Blinking Block (Default) */
 		case 2: /* Steady Block */
+			xdrawglyphbg(g, cx, cy);
 #ifndef LIGATURES
 			xdrawglyph(g, cx, cy);
 #else
-			xdrawglyphbg(g, cx, cy);
 			xdrawglyph(g, cx, cy, NULL);
 #endif
+			xdrawdecorations(&g, 1, cx, cy, NULL);
 			break;
 		case 3: /* Blinking Underline */
 		case 4: /* Steady Underline */
 			pixman_image_fill_rectangles(
-			    PIXMAN_OP_SRC, pix, drawcol, 1,
+			    PIXMAN_OP_SRC, pix, &drawcol.c, 1,
 			    &(pixman_rectangle16_t){x, y + win.ch - thicc,
 						    win.cw, thicc});
 			break;
 		case 5: /* Blinking bar */
 		case 6: /* Steady bar */
 			pixman_image_fill_rectangles(
-			    PIXMAN_OP_SRC, pix, drawcol, 1,
+			    PIXMAN_OP_SRC, pix, &drawcol.c, 1,
 			    &(pixman_rectangle16_t){x, y, thicc, win.ch});
 			break;
 		}
 	} else {
-		pixman_image_fill_rectangles(PIXMAN_OP_SRC, pix, drawcol, 4,
+		pixman_image_fill_rectangles(PIXMAN_OP_SRC, pix, &drawcol.c, 4,
 					     (pixman_rectangle16_t[4]){
 						 {x,              y,              win.cw, 1     },
 						 {x,              y,              1,      win.ch},
@@ -977,19 +1716,24 @@ int xstartdraw(void)
 
 	if (!swt.need_draw || wl.callback) return 0;
 
-	wl.callback = wl_surface_frame(wl.surface);
-	wl_callback_add_listener(wl.callback, &listener.wl_callback, NULL);
-	wl_surface_commit(wl.surface);
-
-	buf = bufpool_getbuf(&swt.pool, wl.shm, win.w, win.h, &resized);
+	errno = 0;
+	buf   = bufpool_getbuf(&swt.pool, wl.shm, win.w, win.h, &resized);
+	swt.need_buf = !buf;
 	if (!buf) {
-		warn(errno ? "bufpool_getbuf:" : "no buffer available");
+		/* the compositor holds all of them, bufrelease() retries */
+		if (errno) warn("bufpool_getbuf:");
 		return 0;
 	}
 
+	wl.callback = wl_surface_frame(wl.surface);
+	wl_callback_add_listener(wl.callback, &listener.wl_callback, NULL);
+	wl_surface_commit(wl.surface);
+
+	swt.buf = buf;
 	swt.pix = buf->pix;
 
-	if (resized) xclear(0, 0, win.w, win.h);
+	if (!bufpool_copyforward(&swt.pool, buf) && resized)
+		xclear(0, 0, win.w, win.h);
 
 	/* TODO: ensure window is visible */
 
@@ -1003,42 +1747,135 @@ int xstartdraw(void)
 void xdrawline(Line line, int x1, int y1, int x2)
 {
 #ifndef LIGATURES
+	char done[x2 - x1];
+	struct fcft_font *f;
+	Color fg;
 	Glyph g;
-	for (; x1 < x2; x1++) {
-		g = line[x1];
-		if (g.mode == ATTR_WDUMMY) continue;
-		xdrawglyph(g, x1, y1);
+#ifdef BLIT
+	const struct fcft_glyph *glyph;
+	int x, winy = borderpx + y1 * win.ch;
+#else
+	pixman_glyph_t glyphs[x2 - x1];
+	const void *cg;
+	Color runfg;
+	int x, n = 0, winy = borderpx + y1 * win.ch;
+#endif
+
+	xdrawborders(x1, y1, x2);
+	xdrawbg(line, x1, y1, x2);
+
+	/* blanks need nothing more, the cells that fit are copied */
+	for (x = x1; x < x2; x++) {
+		g           = line[x];
+		done[x - x1] = g.mode == ATTR_WDUMMY ||
+			       (g.u == ' ' &&
+				!(g.mode & (ATTR_UNDERLINE | ATTR_STRUCK))) ||
+			       xdrawtile(g, x, y1);
+	}
+
+#ifdef BLIT
+	for (x = x1; x < x2; x++) {
+		g = line[x];
+		if (done[x - x1]) continue;
+		f  = xfont(FONTIDX(g.mode));
+		fg = xglyphfg(g);
+		if ((glyph = xrasterize(FONTIDX(g.mode), g.u)))
+			xblitglyph(glyph, borderpx + x * win.cw,
+				   winy + win.ch - f->descent, &fg);
 	}
 #else
-	struct fcft_font *f;
-	struct fcft_text_run *run;
+	/* the glyphs of each run of the same color in one go */
+	pixman_glyph_cache_freeze(dc.glyphs);
+	for (x = x1; x < x2; x++) {
+		g = line[x];
+		if (done[x - x1]) continue;
+		f  = xfont(FONTIDX(g.mode));
+		fg = xglyphfg(g);
+		if (n > 0 && memcmp(&fg.c, &runfg.c, sizeof(fg.c))) {
+			xdrawglyphs(glyphs, n, &runfg);
+			n = 0;
+		}
+		if (n == 0) runfg = fg;
+		if (!(cg = xglyph(FONTIDX(g.mode), g.u))) continue;
+		glyphs[n++] = (pixman_glyph_t){borderpx + x * win.cw,
+					       winy + win.ch - f->descent, cg};
+	}
+	xdrawglyphs(glyphs, n, &runfg);
+	pixman_glyph_cache_thaw(dc.glyphs);
+#endif
+
+	xdrawdecorations(line + x1, x2 - x1, x1, y1, done);
+#else
+	const struct fcft_text_run *run;
 	Rune t[x2 - x1];
-	uint i, len = 0, x = x1;
-	ushort relevant = ATTR_BOLD | ATTR_ITALIC | ATTR_WDUMMY;
-
-	for (; x1 < x2; x1++) {
-		if (~line[x1].mode & ATTR_WDUMMY) t[len++] = line[x1].u;
-		if (len != 0 &&
-		    (x1 + 1 == x2 || ((line[x1 + 0].mode & relevant) !=
-				      (line[x1 + 1].mode & relevant)))) {
-			f   = dc.font[(!!(line[x1].mode & ATTR_BOLD)) +
-                                    (!!(line[x1].mode & ATTR_ITALIC)) * 2];
-			run = fcft_rasterize_text_run_utf32(f, len, t,
-							    FCFT_SUBPIXEL_NONE);
-			for (i = 0; i < len; i++)
-				xdrawglyphbg(line[x + i], x + i, y1);
-			for (i = 0; i < len; i++, x++)
-				xdrawglyph(line[x], x, y1, run->glyphs[i]);
-			fcft_text_run_destroy(run);
-			len = 0;
+	int cell[x2 - x1];
+	int x, e, c, len;
+	size_t i;
+
+	xdrawborders(x1, y1, x2);
+	xdrawbg(line, x1, y1, x2);
+	for (x = x1; x < x2; x = e) {
+		len = 0;
+		for (e = x; e < x2 && RUNMODE(line, e) == RUNMODE(line, x);
+		     e++) {
+			if (line[e].mode & ATTR_WDUMMY) continue;
+			cell[len] = e;
+			t[len++]  = line[e].u;
+		}
+		if (len == 0) continue;
+
+		if (!(run = xshape(FONTIDX(RUNMODE(line, x)), t, len))) {
+			for (c = 0; c < len; c++)
+				xdrawglyph(line[cell[c]], cell[c], y1, NULL);
+			continue;
+		}
+		/* a glyph is drawn in the cell of the first rune it shows */
+		for (i = 0; i < run->count; i++) {
+			c = cell[run->cluster[i]];
+			xdrawglyph(line[c], c, y1, run->glyphs[i]);
 		}
 	}
+	xdrawdecorations(line + x1, x2 - x1, x1, y1, NULL);
 #endif
 }
 
+/* moves the drawn rows top to bot up by n rows, down if n is negative */
+void xscroll(int top, int bot, int n)
+{
+	char *p    = (char *)pixman_image_get_data(swt.pix) + borderpx * 4;
+	int stride = pixman_image_get_stride(swt.pix);
+	int d = n * win.ch, h = (bot - top + 1 - abs(n)) * win.ch;
+	int y0 = borderpx + (top + MAX(-n, 0)) * win.ch, y;
+
+	/* rows of pixels never overlap, but must not be overwritten first */
+	if (n > 0) {
+		for (y = y0; y < y0 + h; y++)
+			memcpy(p + y * stride, p + (y + d) * stride, win.tw * 4);
+	} else {
+		for (y = y0 + h - 1; y >= y0; y--)
+			memcpy(p + y * stride, p + (y + d) * stride, win.tw * 4);
+	}
+	xdamage(borderpx, y0, win.tw, h);
+}
+
 void xfinishdraw(void)
 {
-	wl_surface_damage(wl.surface, 0, 0, win.w, win.h);
+	pixman_box32_t *b;
+	int i, n;
+
+	if (wl_surface_get_version(wl.surface) >=
+	    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION) {
+		b = pixman_region32_rectangles(&swt.damage, &n);
+		for (i = 0; i < n; i++)
+			wl_surface_damage_buffer(wl.surface, b[i].x1, b[i].y1,
+						 b[i].x2 - b[i].x1,
+						 b[i].y2 - b[i].y1);
+	} else if (pixman_region32_not_empty(&swt.damage)) {
+		/* surface coordinates, which are scaled */
+		wl_surface_damage(wl.surface, 0, 0, win.w, win.h);
+	}
+	bufpool_damage(&swt.pool, swt.buf, &swt.damage);
+	pixman_region32_clear(&swt.damage);
 	wl_surface_commit(wl.surface);
 }
 
@@ -1151,6 +1988,13 @@ void kpress(uint32_t key, xkb_keysym_t keysym)
 	swt.need_draw = true;
 }
 
+void bufrelease(void *data)
+{
+	(void)data;
+
+	if (swt.need_buf) draw();
+}
+
 /* wayland functions {{{ */
 void wl_callback_done(void *data, struct wl_callback *wl_callback,
 		      uint32_t callback_data)
@@ -1330,7 +2174,7 @@ void wl_output_done(void *data, struct wl_output *wl_output)
 {
 	(void)data;
 	(void)wl_output;
-	xunloadfonts();
+	/* nothing is loaded if neither the scale nor the size changed */
 	xloadfonts(usedfont, defaultfontsize);
 }
 
@@ -1571,6 +2415,9 @@ void xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 	if (width == win.w && height == win.h) return;
 
 	cresize(width, height);
+	/* grow the pool now, so the draw doesn't have to */
+	if (bufpool_reserve(&swt.pool, wl.shm, win.w * 4 * win.h) < 0)
+		warn("bufpool_reserve:");
 
 	swt.need_draw = true;
 }
@@ -1618,6 +2465,14 @@ void setup(void)
 	if (!xdg.wm_base) die("no xdg wm base registered");
 	if (!argb) die("ARGB format is not supported");
 
+	pixman_region32_init(&swt.damage);
+	swt.pool.n = buffers;
+	LIMIT(swt.pool.n, 1, BUFPOOL_MAX);
+	swt.pool.release = bufrelease;
+#ifdef BLIT
+	blitinit();
+#endif
+
 	wl.surface = wl_compositor_create_surface(wl.compositor);
 	if (!wl.surface) die("wl_compositor_create_surface:");
 
@@ -1755,6 +2610,8 @@ void usage(void)
 
 void cleanup(void)
 {
+	size_t i;
+
 #define s(f, o)                                                                \
 	do {                                                                   \
 		if (o != NULL) f(o);                                           \
@@ -1764,10 +2621,18 @@ void cleanup(void)
 	close(swt.fd.repeat);
 
 	tfree();
+	for (i = 0; dc.col && i < dc.collen; i++)
+		s(pixman_image_unref, dc.col[i].fill);
+	for (i = 0; i < FILLCACHE; i++)
+		s(pixman_image_unref, dc.fills[i].fill);
+#if defined(TILESTATS) && !defined(LIGATURES)
+	warn("tiles: %lu hits, %lu misses", dc.tiles.hits, dc.tiles.misses);
+#endif
 	s(free, dc.col);
 	xunloadfonts();
 	fcft_fini();
 	bufpool_cleanup(&swt.pool);
+	pixman_region32_fini(&swt.damage);
 
 	s(xkb_keymap_unref, xkb.keymap);
 	s(xkb_state_unref, xkb.state);